@@ -3,10 +3,23 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
 
 #include "lock_client.h"
 
+// What a client call reports when an extent server call fails.
+static chfs_client::status failure(extent_protocol::status ret) {
+  switch (ret) {
+    case extent_protocol::NOSPC:
+      return chfs_client::NOSPC;
+    case extent_protocol::FBIG:
+      return chfs_client::FBIG;
+    default:
+      return chfs_client::IOERR;
+  }
+}
+
 chfs_client::chfs_client(std::string extent_dst, std::string lock_dst) {
   ec = new extent_client(extent_dst);
   lc = new lock_client(lock_dst);
@@ -98,24 +111,23 @@ int chfs_client::getdir(inum inum, dirinfo &din) {
 
 // Only support set size of attr
 int chfs_client::setattr(inum ino, size_t size) {
+  // Sizes travel as 32 bits; the extent server checks the exact limit.
+  if (size > UINT32_MAX) {
+    return FBIG;
+  }
   chfs_command::txid_t txid;
   ec->start_tx(txid);
 
-  auto buf = std::string();
-
-  if (ec->get(ino, buf) != extent_protocol::OK) {
+  auto ret = ec->truncate(ino, size, txid);
+  if (ret != extent_protocol::OK) {
     ec->abort_tx(txid);
-    return IOERR;
+    return failure(ret);
   }
 
-  buf.resize(size, 0);
-  if (ec->put(ino, buf, txid) != extent_protocol::OK) {
-    ec->abort_tx(txid);
+  if (ec->commit_tx(txid) != extent_protocol::OK) {
     return IOERR;
   }
 
-  ec->commit_tx(txid);
-
   return OK;
 }
 
@@ -149,9 +161,15 @@ int chfs_client::create(inum parent, const char *name, mode_t mode,
 
   *(reinterpret_cast<uint32_t *>(&buf[buf.size() - 4])) = ino_out;
   buf.insert(buf.end(), n.begin(), n.end());
-  ec->put(parent, buf, txid);
+  auto ret = ec->put(parent, buf, txid);
+  if (ret != extent_protocol::OK) {
+    ec->abort_tx(txid);
+    return failure(ret);
+  }
 
-  ec->commit_tx(txid);
+  if (ec->commit_tx(txid) != extent_protocol::OK) {
+    return IOERR;
+  }
 
   return OK;
 }
@@ -186,9 +204,15 @@ int chfs_client::mkdir(inum parent, const char *name, mode_t mode,
   buf.resize(buf.size() + 4, 0);
   *(reinterpret_cast<uint32_t *>(&buf[buf.size() - 4])) = ino_out;
   buf.insert(buf.end(), n.begin(), n.end());
-  ec->put(parent, buf, txid);
+  auto ret = ec->put(parent, buf, txid);
+  if (ret != extent_protocol::OK) {
+    ec->abort_tx(txid);
+    return failure(ret);
+  }
 
-  ec->commit_tx(txid);
+  if (ec->commit_tx(txid) != extent_protocol::OK) {
+    return IOERR;
+  }
 
   return OK;
 }
@@ -234,46 +258,48 @@ int chfs_client::readdir(inum dir, std::list<dirent> &list) {
 }
 
 int chfs_client::read(inum ino, size_t size, off_t off, std::string &data) {
-  auto buf = std::string();
-
-  if (ec->get(ino, buf) != extent_protocol::OK) {
+  data.clear();
+  if (off < 0) {
+    return IOERR;
+  }
+  // No file reaches past 32 bits, so there is nothing to read there.
+  if (static_cast<uint64_t>(off) >= UINT32_MAX) {
+    return OK;
+  }
+  if (ec->read_range(ino, off, std::min<size_t>(size, UINT32_MAX), data) !=
+      extent_protocol::OK) {
     return IOERR;
   }
-
-  int begin = std::min((int)off, (int)buf.size());
-  int end = std::min((int)size + (int)off, (int)buf.size());
-  data = std::string(buf.begin() + begin, buf.begin() + end);
 
   return OK;
 }
 
 int chfs_client::write(inum ino, size_t size, off_t off, const char *data,
                        size_t &bytes_written) {
+  if (off < 0) {
+    return IOERR;
+  }
+  // Offsets and sizes travel as 32 bits; the extent server checks the
+  // exact limit.
+  if (static_cast<uint64_t>(off) > UINT32_MAX ||
+      size > UINT32_MAX - static_cast<uint64_t>(off)) {
+    return FBIG;
+  }
   chfs_command::txid_t txid;
   ec->start_tx(txid);
 
-  auto buf = std::string();
-  if (ec->get(ino, buf) != extent_protocol::OK) {
+  auto ret = ec->write_range(ino, off, {data, size}, txid);
+  if (ret != extent_protocol::OK) {
     ec->abort_tx(txid);
 
-    return IOERR;
-  }
-  if (off + size > buf.size()) {
-    buf.resize(off + size, 0);
+    return failure(ret);
   }
   bytes_written = size;
-  for (uint32_t i = 0; i < size; ++i) {
-    buf[off + i] = data[i];
-  }
-
-  if (ec->put(ino, buf, txid) != extent_protocol::OK) {
-    ec->abort_tx(txid);
 
+  if (ec->commit_tx(txid) != extent_protocol::OK) {
     return IOERR;
   }
 
-  ec->commit_tx(txid);
-
   return OK;
 }
 
@@ -299,9 +325,15 @@ int chfs_client::unlink(inum parent, const char *name) {
     if (memcmp(&buf[i], name, len) == 0) {
       buf.erase(buf.begin() + i - 5, buf.begin() + i + len);
 
-      ec->put(parent, buf, txid);
+      auto ret = ec->put(parent, buf, txid);
+      if (ret != extent_protocol::OK) {
+        ec->abort_tx(txid);
+        return failure(ret);
+      }
 
-      ec->commit_tx(txid);
+      if (ec->commit_tx(txid) != extent_protocol::OK) {
+        return IOERR;
+      }
 
       return OK;
     }
@@ -335,7 +367,11 @@ int chfs_client::symlink(chfs_client::inum parent, const char *link,
   }
 
   std::string l(link);
-  ec->put(ino_out, {l.begin(), l.end()}, txid);
+  auto ret = ec->put(ino_out, {l.begin(), l.end()}, txid);
+  if (ret != extent_protocol::OK) {
+    ec->abort_tx(txid);
+    return failure(ret);
+  }
 
   auto buf = std::string();
   ec->get(parent, buf);
@@ -345,9 +381,15 @@ int chfs_client::symlink(chfs_client::inum parent, const char *link,
   buf.resize(buf.size() + 4, 0);
   *(reinterpret_cast<uint32_t *>(&buf[buf.size() - 4])) = ino_out;
   buf.insert(buf.end(), n.begin(), n.end());
-  ec->put(parent, buf, txid);
+  ret = ec->put(parent, buf, txid);
+  if (ret != extent_protocol::OK) {
+    ec->abort_tx(txid);
+    return failure(ret);
+  }
 
-  ec->commit_tx(txid);
+  if (ec->commit_tx(txid) != extent_protocol::OK) {
+    return IOERR;
+  }
 
   return OK;
 }
@@ -19,7 +19,9 @@ class chfs_client {
     RPCERR,
     NOENT,  // No such file or directory
     IOERR,
-    EXIST
+    EXIST,
+    NOSPC,  // No space left on the extent server's disk
+    FBIG    // Past the largest file size
   };
   typedef int status;
 
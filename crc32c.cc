@@ -0,0 +1,59 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Reflected form of the Castagnoli polynomial.
+#define CRC32C_POLY 0x82f63b78
+
+struct crc32c_table {
+  uint32_t t[256];
+  crc32c_table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+      }
+      t[i] = c;
+    }
+  }
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t n) {
+  static const crc32c_table table;
+  for (; n != 0; --n, ++p) {
+    crc = table.t[(crc ^ *p) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc, const unsigned char *p, size_t n) {
+  uint64_t c = crc;
+  for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = static_cast<uint32_t>(c);
+  for (; n != 0; --n, ++p) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c_extend(uint32_t crc, const void *data, size_t n) {
+  auto *p = static_cast<const unsigned char *>(data);
+#if defined(__x86_64__)
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  if (hw) {
+    return ~crc32c_hw(~crc, p, n);
+  }
+#endif
+  return ~crc32c_sw(~crc, p, n);
+}
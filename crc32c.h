@@ -0,0 +1,16 @@
+#ifndef crc32c_h
+#define crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of n bytes at data, continuing from crc, the result
+// of an earlier call or 0 to start. Uses the SSE4.2 crc32 instruction when
+// the CPU has it.
+uint32_t crc32c_extend(uint32_t crc, const void *data, size_t n);
+
+inline uint32_t crc32c(const void *data, size_t n) {
+  return crc32c_extend(0, data, n);
+}
+
+#endif
@@ -25,6 +25,26 @@ extent_protocol::status extent_client::get(extent_protocol::extentid_t eid,
   return cl->call(extent_protocol::get, eid, buf);
 }
 
+extent_protocol::status extent_client::read_range(
+    extent_protocol::extentid_t eid, uint32_t off, uint32_t size,
+    std::string &buf) {
+  return cl->call(extent_protocol::read_range, eid, off, size, buf);
+}
+
+extent_protocol::status extent_client::write_range(
+    extent_protocol::extentid_t eid, uint32_t off, std::string buf,
+    chfs_command::txid_t txid) {
+  int ignore;
+  return cl->call(extent_protocol::write_range, eid, txid, off, buf, ignore);
+}
+
+extent_protocol::status extent_client::truncate(
+    extent_protocol::extentid_t eid, uint32_t size,
+    chfs_command::txid_t txid) {
+  int ignore;
+  return cl->call(extent_protocol::truncate, eid, txid, size, ignore);
+}
+
 extent_protocol::status extent_client::getattr(extent_protocol::extentid_t eid,
                                                extent_protocol::attr &attr) {
   return cl->call(extent_protocol::getattr, eid, attr);
@@ -43,6 +63,13 @@ extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid,
   return cl->call(extent_protocol::remove, eid, txid, ignore);
 }
 
+extent_protocol::status extent_client::clone(extent_protocol::extentid_t src,
+                                             extent_protocol::extentid_t dst,
+                                             chfs_command::txid_t txid) {
+  int ignore;
+  return cl->call(extent_protocol::clone, src, dst, txid, ignore);
+}
+
 extent_protocol::status extent_client::start_tx(chfs_command::txid_t &txid) {
   int ignore{};
   return cl->call(extent_protocol::start_tx, ignore, txid);
@@ -56,4 +83,28 @@ extent_protocol::status extent_client::commit_tx(chfs_command::txid_t txid) {
 extent_protocol::status extent_client::abort_tx(chfs_command::txid_t txid) {
   int ignore;
   return cl->call(extent_protocol::abort_tx, txid, ignore);
-}
\ No newline at end of file
+}
+extent_protocol::status extent_client::stats(std::string &out) {
+  int ignore{};
+  return cl->call(extent_protocol::stats, ignore, out);
+}
+
+extent_protocol::status extent_client::snapshot_create(uint32_t &id) {
+  int ignore{};
+  return cl->call(extent_protocol::snapshot_create, ignore, id);
+}
+
+extent_protocol::status extent_client::snapshot_delete(uint32_t id) {
+  int ignore{};
+  return cl->call(extent_protocol::snapshot_delete, id, ignore);
+}
+
+extent_protocol::status extent_client::snapshot_list(std::string &out) {
+  int ignore{};
+  return cl->call(extent_protocol::snapshot_list, ignore, out);
+}
+
+extent_protocol::status extent_client::snapshot_get(
+    uint32_t snap, extent_protocol::extentid_t eid, std::string &buf) {
+  return cl->call(extent_protocol::snapshot_get, snap, eid, buf);
+}
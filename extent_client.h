@@ -17,13 +17,31 @@ class extent_client {
                                  extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid,
                               std::string &buf);
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     uint32_t off, uint32_t size,
+                                     std::string &buf);
+  extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                      uint32_t off, std::string buf,
+                                      chfs_command::txid_t txid);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   uint32_t size, chfs_command::txid_t txid);
   extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                   extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf,
                               chfs_command::txid_t txid);
   extent_protocol::status remove(extent_protocol::extentid_t eid,
                                  chfs_command::txid_t txid);
+  extent_protocol::status clone(extent_protocol::extentid_t src,
+                                extent_protocol::extentid_t dst,
+                                chfs_command::txid_t txid);
   extent_protocol::status start_tx(chfs_command::txid_t &txid);
   extent_protocol::status commit_tx(chfs_command::txid_t txid);
   extent_protocol::status abort_tx(chfs_command::txid_t txid);
+  extent_protocol::status stats(std::string &out);
+  extent_protocol::status snapshot_create(uint32_t &id);
+  extent_protocol::status snapshot_delete(uint32_t id);
+  extent_protocol::status snapshot_list(std::string &out);
+  extent_protocol::status snapshot_get(uint32_t snap,
+                                       extent_protocol::extentid_t eid,
+                                       std::string &buf);
 };
@@ -9,7 +9,7 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, NOSPC, FBIG };
   enum rpc_numbers {
     put = 0x6001,
     get,
@@ -19,6 +19,15 @@ class extent_protocol {
     start_tx,
     commit_tx,
     abort_tx,
+    read_range,
+    write_range,
+    truncate,
+    stats,
+    snapshot_create,
+    snapshot_list,
+    snapshot_get,
+    clone,
+    snapshot_delete,
   };
 
   enum types { T_DIR = 1, T_FILE, T_LINK };
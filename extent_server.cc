@@ -9,76 +9,554 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <sstream>
+#include <unordered_set>
 
 #include "persister.h"
 
-extent_server::extent_server() : txid_(0) {
-  int ignore;
+// A CMD_WRITE record carries the file offset ahead of the written bytes;
+// a CMD_TRUNCATE record is just the new size, a CMD_SNAPSHOT or
+// CMD_SNAPSHOT_DELETE one the id and a CMD_CLONE one the source inode.
+static uint32_t decode_offset(const char *data) {
+  uint32_t off;
+  memcpy(&off, data, sizeof(off));
+  return off;
+}
+
+// Granularity at which encode_delta compares contents. Two changes closer
+// than this share a range.
+#define DELTA_CHUNK 64
+
+static void append_u32(std::string &s, uint32_t v) {
+  s.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+/* A CMD_DELTA record turns one version of a file into the next: the new
+ * size, then an offset, a length and the bytes of every range that
+ * differs. Unchanged chunks are skipped, and each range is trimmed to the
+ * bytes that actually changed. */
+static std::string encode_delta(const std::string &from,
+                                const std::string &to) {
+  std::string delta;
+  append_u32(delta, to.size());
+  auto common = std::min(from.size(), to.size());
+  for (size_t pos = 0; pos < common;) {
+    auto n = std::min<size_t>(DELTA_CHUNK, common - pos);
+    if (memcmp(&from[pos], &to[pos], n) == 0) {
+      pos += n;
+      continue;
+    }
+    auto start = pos;
+    while (from[start] == to[start]) {
+      ++start;
+    }
+    auto end = pos + n;
+    while (end < common) {
+      n = std::min<size_t>(DELTA_CHUNK, common - end);
+      if (memcmp(&from[end], &to[end], n) == 0) {
+        break;
+      }
+      end += n;
+    }
+    pos = end;
+    while (from[end - 1] == to[end - 1]) {
+      --end;
+    }
+    append_u32(delta, start);
+    append_u32(delta, end - start);
+    delta.append(to, start, end - start);
+  }
+  if (to.size() > common) {
+    append_u32(delta, common);
+    append_u32(delta, to.size() - common);
+    delta.append(to, common, std::string::npos);
+  }
+  return delta;
+}
+
+static void apply_delta(const char *delta, uint32_t n, std::string &data) {
+  uint32_t size, off, len;
+  uint32_t pos = 0;
+  memcpy(&size, delta + pos, sizeof(size));
+  pos += sizeof(size);
+  data.resize(size);
+  while (pos < n) {
+    memcpy(&off, delta + pos, sizeof(off));
+    memcpy(&len, delta + pos + sizeof(off), sizeof(len));
+    pos += sizeof(off) + sizeof(len);
+    data.replace(off, len, delta + pos, len);
+    pos += len;
+  }
+}
 
-  // inode manager
-  im = new inode_manager();
+extent_server::extent_server(uint32_t block_size, uint64_t disk_size,
+                             uint32_t ninodes, enum atime_mode atime,
+                             const std::string &image)
+    : txid_(0),
+      dirty_bytes_(0),
+      flocks_(new std::mutex[NINODE_LOCKS]),
+      busy_(0),
+      tx_held_(false),
+      defrag_stop_(false),
+      defrag_cursor_(1),
+      relocated_files_(0),
+      relocated_blocks_(0),
+      checkpoint_stop_(false),
+      checkpoint_wanted_(false),
+      checkpoint_lsn_(0),
+      checkpoints_(0) {
+  // inode manager. The image only changes at checkpoints; without one of
+  // its own the disk is checkpointed to an image next to the log.
+  im = new inode_manager(block_size, disk_size, ninodes,
+                         image.empty() ? CHECKPOINT_IMAGE : image);
+  im->set_atime_mode(atime);
 
   // persistence
 
   _persister = new chfs_persister("log");  // DO NOT change the dir name here
 
-  _persister->restore_checkpoint();
+  // The image holds everything up to the last checkpoint, so only the
+  // log is replayed.
   _persister->restore_logdata();
+  _persister->resume_at(im->checkpoint_lsn());
+  txid_ = _persister->get_txid();
 
-  for (const auto &i : _persister->bin_entries) {
-    switch (i.type_) {
-      case chfs_command::CMD_CREATE:
-        occupy(i.inum_, (i.data_[0] << 0) + (i.data_[1] << 8) +
-                            (i.data_[2] << 16) + (i.data_[3] << 24));
-        break;
-      case chfs_command::CMD_PUT:
-        put(i.inum_, 0, i.data_, ignore);
+  std::set<chfs_command::txid_t> unfinished;
+  recover(unfinished);
+  _persister->end_restore();
+  write_back();
+  _persister->start_persist();
+  // Nobody is left to finish those, so the next checkpoint may drop them.
+  for (auto txid : unfinished) {
+    _persister->append_log({txid, chfs_command::cmd_type::CMD_ABORT, 0, {}});
+  }
+}
+
+/* Replay the committed transactions of the restored log on top of the
+ * image. Records before the log position the image was checkpointed at
+ * are in it already and skipped: a crash between writing the image and
+ * cutting the log leaves them behind, and replaying a clone or a delta
+ * twice is wrong. Snapshots and clones look at more than one file, so
+ * they split the log into segments that are replayed one after the other.
+ * Within a segment only the records that decide each file's final state
+ * are kept, and files are replayed in parallel. Transactions that never
+ * finished are returned in unfinished. */
+void extent_server::recover(std::set<chfs_command::txid_t> &unfinished) {
+  const auto &log = _persister->restored;
+  auto covered = im->checkpoint_lsn();
+  std::unordered_set<chfs_command::txid_t> committed, aborted;
+  for (const auto &r : log) {
+    if (r.type == chfs_command::CMD_COMMIT) {
+      committed.insert(r.txid);
+    } else if (r.type == chfs_command::CMD_ABORT) {
+      aborted.insert(r.txid);
+    }
+  }
+
+  std::vector<const log_record *> segment;
+  size_t applied = 0;
+  for (const auto &r : log) {
+    if (r.lsn < covered) {
+      continue;
+    }
+    if (committed.count(r.txid) == 0) {
+      if (aborted.count(r.txid) == 0) {
+        std::cout << __PRETTY_FUNCTION__ << ": uncommitted log " << r.txid
+                  << " " << r.type << std::endl;
+        unfinished.insert(r.txid);
+      }
+      continue;
+    }
+    switch (r.type) {
+      case chfs_command::CMD_BEGIN:
+      case chfs_command::CMD_COMMIT:
         break;
-      case chfs_command::CMD_REMOVE:
-        remove(i.inum_, 0, ignore);
+      case chfs_command::CMD_SNAPSHOT:
+      case chfs_command::CMD_SNAPSHOT_DELETE:
+      case chfs_command::CMD_CLONE:
+        applied += replay_segment(segment) + 1;
+        segment.clear();
+        replay(r);
         break;
       default:
+        segment.push_back(&r);
         break;
     }
   }
+  applied += replay_segment(segment);
+  std::cout << __PRETTY_FUNCTION__ << ": replayed " << applied << " of "
+            << log.size() << " log entries" << std::endl;
+}
+
+/* Replay a segment of the log file by file, last writer wins: nothing
+ * before a file's last remove matters, and of its contents only the last
+ * put and what follows it. Return the number of records replayed. */
+size_t extent_server::replay_segment(
+    const std::vector<const log_record *> &segment) {
+  std::unordered_map<uint32_t, std::vector<const log_record *>> files;
+  for (const auto *r : segment) {
+    files[r->inum].push_back(r);
+  }
 
-  std::set<chfs_command::txid_t> finished;
-  for (const auto &i : _persister->log_entries) {
-    if (i.type_ == chfs_command::CMD_COMMIT) {
-      finished.insert(i.txid_);
+  std::vector<std::vector<const log_record *>> work;
+  size_t applied = 0;
+  for (auto &f : files) {
+    const auto &ops = f.second;
+    size_t from = 0, last_put = ops.size();
+    for (size_t k = 0; k < ops.size(); ++k) {
+      if (ops[k]->type == chfs_command::CMD_REMOVE) {
+        from = k;
+        last_put = ops.size();
+      } else if (ops[k]->type == chfs_command::CMD_PUT) {
+        last_put = k;
+      }
+    }
+    std::vector<const log_record *> kept;
+    for (size_t k = from; k < ops.size(); ++k) {
+      if (ops[k]->type == chfs_command::CMD_REMOVE ||
+          ops[k]->type == chfs_command::CMD_CREATE || last_put == ops.size() ||
+          k >= last_put) {
+        kept.push_back(ops[k]);
+      }
     }
+    applied += kept.size();
+    work.push_back(std::move(kept));
   }
 
-  for (const auto &i : _persister->log_entries) {
-    if (finished.count(i.txid_) != 0) {
-      switch (i.type_) {
-        case chfs_command::CMD_CREATE:
-          occupy(i.inum_, (i.data_[0] << 0) + (i.data_[1] << 8) +
-                              (i.data_[2] << 16) + (i.data_[3] << 24));
-          break;
-        case chfs_command::CMD_PUT:
-          put(i.inum_, 0, i.data_, ignore);
-          break;
-        case chfs_command::CMD_REMOVE:
-          remove(i.inum_, 0, ignore);
-          break;
-        default:
-          break;
+  std::atomic<size_t> next(0);
+  auto worker = [&] {
+    for (size_t k; (k = next++) < work.size();) {
+      for (const auto *r : work[k]) {
+        replay(*r);
       }
+    }
+  };
+  auto nthreads = std::min<size_t>(
+      {std::max(std::thread::hardware_concurrency(), 1u), RECOVERY_THREADS,
+       work.size()});
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < nthreads; ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+  return applied;
+}
+
+/* Redo one logged operation. */
+void extent_server::replay(const log_record &r) {
+  int ignore;
+  switch (r.type) {
+    case chfs_command::CMD_CREATE:
+      occupy(r.inum, decode_offset(r.data));
+      break;
+    case chfs_command::CMD_PUT:
+      store(r.inum, std::string(r.data, r.size));
+      break;
+    case chfs_command::CMD_DELTA: {
+      std::string data;
+      contents(r.inum, data);
+      apply_delta(r.data, r.size, data);
+      store(r.inum, std::move(data));
+      break;
+    }
+    case chfs_command::CMD_WRITE:
+      patch_range(r.inum, decode_offset(r.data),
+                  std::string(r.data + sizeof(uint32_t),
+                              r.size - sizeof(uint32_t)));
+      break;
+    case chfs_command::CMD_TRUNCATE:
+      resize(r.inum, decode_offset(r.data));
+      break;
+    case chfs_command::CMD_RELOCATE:
+      im->relocate(r.inum);
+      break;
+    case chfs_command::CMD_SNAPSHOT:
+      if (decode_offset(r.data) > im->generation()) {
+        write_back();
+        im->snapshot();
+      }
+      break;
+    case chfs_command::CMD_SNAPSHOT_DELETE:
+      im->delete_snapshot(decode_offset(r.data));
+      break;
+    case chfs_command::CMD_REMOVE:
+      remove(r.inum, 0, ignore);
+      break;
+    case chfs_command::CMD_CLONE:
+      clone(decode_offset(r.data), r.inum, 0, ignore);
+      break;
+    default:
+      break;
+  }
+}
+
+extent_server::~extent_server() {
+  stop_defrag();
+  stop_checkpoint();
+}
+
+/* Start moving fragmented files into contiguous runs in the background,
+ * one file every interval_ms. */
+void extent_server::start_defrag(unsigned interval_ms) {
+  if (defrag_thread_.joinable() || interval_ms == 0) {
+    return;
+  }
+  defrag_stop_ = false;
+  defrag_thread_ = std::thread(&extent_server::defrag_loop, this, interval_ms);
+}
+
+void extent_server::stop_defrag() {
+  if (!defrag_thread_.joinable()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> l(defrag_m_);
+    defrag_stop_ = true;
+  }
+  defrag_cv_.notify_all();
+  defrag_thread_.join();
+}
+
+void extent_server::defrag_loop(unsigned interval_ms) {
+  std::unique_lock<std::mutex> l(defrag_m_);
+  while (!defrag_stop_) {
+    l.unlock();
+    defrag_step();
+    l.lock();
+    defrag_cv_.wait_for(l, std::chrono::milliseconds(interval_ms),
+                        [this] { return defrag_stop_; });
+  }
+}
+
+/* Take checkpoints in the background every interval_ms, and whenever a
+ * commit finds the log or the cache past its threshold. With an interval
+ * of 0 only the thresholds trigger one. */
+void extent_server::start_checkpoint(unsigned interval_ms) {
+  stop_checkpoint();
+  checkpoint_stop_ = false;
+  checkpoint_thread_ =
+      std::thread(&extent_server::checkpoint_loop, this, interval_ms);
+}
+
+void extent_server::stop_checkpoint() {
+  if (!checkpoint_thread_.joinable()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> l(checkpoint_m_);
+    checkpoint_stop_ = true;
+  }
+  checkpoint_cv_.notify_all();
+  checkpoint_thread_.join();
+}
+
+void extent_server::checkpoint_loop(unsigned interval_ms) {
+  std::unique_lock<std::mutex> l(checkpoint_m_);
+  auto woken = [this] { return checkpoint_stop_ || checkpoint_wanted_; };
+  while (!checkpoint_stop_) {
+    if (interval_ms == 0) {
+      checkpoint_cv_.wait(l, woken);
     } else {
-      std::cout << __PRETTY_FUNCTION__ << ": uncommitted log " << i.txid_ << " "
-                << i.type_ << std::endl;
+      checkpoint_cv_.wait_for(l, std::chrono::milliseconds(interval_ms),
+                              woken);
     }
+    if (checkpoint_stop_) {
+      break;
+    }
+    checkpoint_wanted_ = false;
+    l.unlock();
+    checkpoint();
+    l.lock();
   }
-  _persister->start_persist();
+}
+
+/* Write out the disk image at a point where no transaction is in
+ * progress, then cut the log there. Anything logged before that point was
+ * applied before it, so the image holds it, and nothing of a transaction
+ * that had not finished. A transaction still open when the log is cut
+ * keeps it from its first record on, so it and everything after it are
+ * replayed in order. Transactions are held back only while the blocks
+ * changed since the last checkpoint are copied; the image is written
+ * after they resume. */
+void extent_server::checkpoint() {
+  std::unique_lock<std::mutex> run(checkpoint_run_m_);
+  if (!quiesce()) {
+    return;
+  }
+  auto lsn = _persister->lsn();
+  if (lsn == checkpoint_lsn_) {
+    resume();
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    write_back();
+  }
+  // Every transaction up to here has finished, and those that never
+  // committed were aborted. The image holds their changes and recovery
+  // skips the log before it, so they are settled once it is saved.
+  chfs_command::txid_t last = txid_;
+  disk_update u;
+  im->checkpoint(u, lsn);
+  resume();
+  im->save(u);
+  {
+    std::unique_lock<std::mutex> l(tx_m_);
+    for (auto it = unsettled_.begin(); it != unsettled_.end();) {
+      it = it->second <= last ? unsettled_.erase(it) : std::next(it);
+    }
+  }
+  if (!_persister->checkpoint(lsn)) {
+    return;
+  }
+  checkpoint_lsn_ = lsn;
+  ++checkpoints_;
+}
+
+/* Look at up to DEFRAG_SCAN inodes from the cursor and relocate the first
+ * fragmented file found. The move is logged and committed like any other
+ * transaction: it changes no contents, so replaying it only redoes the
+ * compaction. Return true if a file was moved. */
+bool extent_server::defrag_step() {
+  auto ninodes = im->ninodes();
+  auto txid = open_tx();
+  for (uint32_t k = 0; k < DEFRAG_SCAN; ++k) {
+    auto inum = defrag_cursor_;
+    defrag_cursor_ = defrag_cursor_ % ninodes + 1;
+    auto moved = im->relocate(inum);
+    if (moved == 0) {
+      continue;
+    }
+    _persister->append_log({txid, chfs_command::cmd_type::CMD_BEGIN, 0, {}});
+    _persister->append_log(
+        {txid, chfs_command::cmd_type::CMD_RELOCATE, inum, {}});
+    _persister->append_log({txid, chfs_command::cmd_type::CMD_COMMIT, 0, {}});
+    _persister->sync_log();
+    close_tx(txid);
+    ++relocated_files_;
+    relocated_blocks_ += moved;
+    return true;
+  }
+  close_tx(txid);
+  return false;
+}
+
+/* Start a transaction, waiting while a checkpoint holds new ones back. */
+chfs_command::txid_t extent_server::open_tx() {
+  std::unique_lock<std::mutex> l(tx_m_);
+  tx_cv_.wait(l, [this] { return !tx_held_; });
+  auto txid = ++txid_;
+  open_.emplace(txid, std::chrono::steady_clock::now());
+  return txid;
+}
+
+void extent_server::close_tx(chfs_command::txid_t txid) {
+  std::unique_lock<std::mutex> l(tx_m_);
+  open_.erase(txid);
+  tx_cv_.notify_all();
+}
+
+/* Hold new transactions back and wait for those in progress to finish.
+ * Any open for over TX_TIMEOUT_MS is aborted instead, as its client is
+ * taken for dead; its changes stay applied, as an abort's do. Later
+ * operations carrying its txid, its commit included, are rejected with
+ * IOERR rather than applied, and a handler of it still running is waited
+ * out. Return false, and let transactions go on, if the rest are not done
+ * within CHECKPOINT_QUIESCE_MS. */
+bool extent_server::quiesce() {
+  std::unique_lock<std::mutex> l(tx_m_);
+  tx_held_ = true;
+  auto now = std::chrono::steady_clock::now();
+  for (auto it = open_.begin(); it != open_.end();) {
+    if (now - it->second > std::chrono::milliseconds(TX_TIMEOUT_MS)) {
+      _persister->append_log(
+          {it->first, chfs_command::cmd_type::CMD_ABORT, 0, {}});
+      it = open_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (!tx_cv_.wait_for(l, std::chrono::milliseconds(CHECKPOINT_QUIESCE_MS),
+                       [this] { return open_.empty() && busy_ == 0; })) {
+    tx_held_ = false;
+    tx_cv_.notify_all();
+    return false;
+  }
+  return true;
+}
+
+extent_server::tx_op::tx_op(extent_server *server, chfs_command::txid_t txid)
+    : es(server), txid(txid) {
+  std::unique_lock<std::mutex> l(es->tx_m_);
+  ok = txid == 0 || es->open_.count(txid) != 0;
+  if (ok) {
+    ++es->busy_;
+  }
+}
+
+extent_server::tx_op::~tx_op() {
+  if (!ok) {
+    return;
+  }
+  std::unique_lock<std::mutex> l(es->tx_m_);
+  --es->busy_;
+  es->tx_cv_.notify_all();
+}
+
+void extent_server::tx_op::changed(extent_protocol::extentid_t id) {
+  if (txid == 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> l(es->tx_m_);
+  es->unsettled_[id] = txid;
+}
+
+bool extent_server::tx_op::settled(extent_protocol::extentid_t id) {
+  std::unique_lock<std::mutex> l(es->tx_m_);
+  auto it = es->unsettled_.find(id);
+  return it == es->unsettled_.end() || it->second == txid;
+}
+
+/* Let transactions start again after quiesce. */
+void extent_server::resume() {
+  std::unique_lock<std::mutex> l(tx_m_);
+  tx_held_ = false;
+  tx_cv_.notify_all();
+}
+
+/* Give blocks to every file held in dirty_. Caller holds dirty_m_, or is
+ * the constructor. store() writes a file at once when the disk is close to
+ * full, so running out of space here takes writes that bypass dirty_
+ * using up what was left. */
+void extent_server::write_back() {
+  for (const auto &i : dirty_) {
+    if (!im->write_file(i.first, i.second.data.data(), i.second.data.size())) {
+      std::cout << __PRETTY_FUNCTION__ << ": no space to write back file "
+                << i.first << std::endl;
+    }
+  }
+  dirty_.clear();
+  dirty_bytes_ = 0;
 }
 
 extent_protocol::status extent_server::create(uint32_t type,
                                               chfs_command::txid_t txid,
                                               extent_protocol::extentid_t &id) {
+  id = 0;
+  tx_op op(this, txid);
+  if (!op.ok) {
+    return extent_protocol::IOERR;
+  }
   id = im->alloc_inode(type);
+  if (id == 0) {
+    return extent_protocol::NOSPC;
+  }
   _persister->append_log({txid,
                           chfs_command::cmd_type::CMD_CREATE,
                           static_cast<uint32_t>(id),
@@ -88,6 +566,7 @@ extent_protocol::status extent_server::create(uint32_t type,
                               static_cast<char>((type >> 16) & 0xff),
                               static_cast<char>((type >> 24) & 0xff),
                           }});
+  op.changed(id);
 
   return extent_protocol::OK;
 }
@@ -99,37 +578,249 @@ extent_protocol::status extent_server::occupy(extent_protocol::extentid_t id,
   return extent_protocol::OK;
 }
 
+/* Log a put as the bytes it changes when that is smaller than the new
+ * contents, so rewriting a large file to edit it logs about the edit. The
+ * file stays locked until the new contents are stored, so the delta is
+ * against the version replay will see, as long as those contents are
+ * committed or this transaction's: a change by a transaction that is
+ * still open, or was aborted, is not replayed before it, so such a put is
+ * logged in full. A put the disk has no room for is
+ * not logged and fails with NOSPC; one past the largest file size fails
+ * with FBIG. */
 int extent_server::put(extent_protocol::extentid_t id,
                        chfs_command::txid_t txid, std::string buf, int &) {
   id &= 0x7fffffff;
+  tx_op op(this, txid);
+  if (!op.ok) {
+    return extent_protocol::IOERR;
+  }
+  if (buf.size() > im->max_file_size()) {
+    return extent_protocol::FBIG;
+  }
 
-  _persister->append_log(
-      {txid, chfs_command::cmd_type::CMD_PUT, static_cast<uint32_t>(id), buf});
+  std::unique_lock<std::mutex> fl(file_lock(id));
+  std::string old;
+  contents(id, old);
+  auto delta = old.empty() || !op.settled(id) ? std::string()
+                                              : encode_delta(old, buf);
+  bool use_delta = !delta.empty() && delta.size() < buf.size();
+  auto record = use_delta ? std::move(delta) : buf;
+  if (!store(id, std::move(buf))) {
+    return extent_protocol::NOSPC;
+  }
+  _persister->append_log({txid,
+                          use_delta ? chfs_command::cmd_type::CMD_DELTA
+                                    : chfs_command::cmd_type::CMD_PUT,
+                          static_cast<uint32_t>(id), record});
+  op.changed(id);
+  return extent_protocol::OK;
+}
+
+/* The current contents of a file, held back or on disk. Not a read, so
+ * the access time stays. */
+void extent_server::contents(extent_protocol::extentid_t id,
+                             std::string &buf) {
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    auto it = dirty_.find(id);
+    if (it != dirty_.end()) {
+      buf = it->second.data;
+      return;
+    }
+  }
+  im->read_file(id, buf, false);
+}
 
-  auto size = buf.size();
-  im->write_file(id, buf.c_str(), size);
+/* Whether more bytes, in files more held files, can be held back: at most
+ * DIRTY_LIMIT bytes in all, and few enough that the free blocks cover
+ * everything held with room for a tail block and a tree block per file,
+ * so a full disk fails the op that fills it rather than a later
+ * write_back. Caller holds dirty_m_. */
+bool extent_server::can_hold(size_t more, size_t files) {
+  auto bytes = dirty_bytes_ + more;
+  auto blocks = bytes / im->block_size() + 2 * (dirty_.size() + files);
+  return bytes <= DIRTY_LIMIT && blocks < im->free_blocks();
+}
 
-  return extent_protocol::OK;
+/* Write the held copy of file id to disk and stop holding it. Return
+ * false, still holding it, if the disk is full. Caller holds dirty_m_. */
+bool extent_server::release(extent_protocol::extentid_t id) {
+  auto it = dirty_.find(id);
+  if (it == dirty_.end()) {
+    return true;
+  }
+  const auto &data = it->second.data;
+  if (!im->write_file(id, data.data(), data.size())) {
+    return false;
+  }
+  dirty_bytes_ -= data.size();
+  dirty_.erase(it);
+  return true;
+}
+
+/* Hold buf back as the new contents of file id. Once it cannot be held,
+ * the held files are written back and buf is written at once. Return
+ * false, with the file unchanged, if the disk is full. */
+bool extent_server::store(extent_protocol::extentid_t id, std::string buf) {
+  extent_protocol::attr a{};
+  im->get_attr(id, a);
+  if (a.type == 0) {
+    return true;
+  }
+
+  std::unique_lock<std::mutex> l(dirty_m_);
+  auto it = dirty_.find(id);
+  if (it != dirty_.end()) {
+    dirty_bytes_ -= it->second.data.size();
+    dirty_.erase(it);
+  }
+  if (can_hold(buf.size(), 1)) {
+    auto &f = dirty_[id];
+    dirty_bytes_ += buf.size();
+    f.data = std::move(buf);
+    f.mtime = time(nullptr);
+    return true;
+  }
+  write_back();
+  return im->write_file(id, buf.data(), buf.size());
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
   id &= 0x7fffffff;
 
-  uint32_t size = 0;
-  char *cbuf = nullptr;
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    auto it = dirty_.find(id);
+    if (it != dirty_.end()) {
+      buf = it->second.data;
+      return extent_protocol::OK;
+    }
+  }
+  im->read_file(id, buf);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::read_range(extent_protocol::extentid_t id, uint32_t off,
+                              uint32_t size, std::string &buf) {
+  id &= 0x7fffffff;
 
-  im->read_file(id, &cbuf, &size);
-  if (size == 0) {
-    buf = {};
-  } else {
-    buf.resize(size, 0);
-    mempcpy(&buf[0], cbuf, size);
-    free(cbuf);
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    auto it = dirty_.find(id);
+    if (it != dirty_.end()) {
+      const auto &data = it->second.data;
+      buf = off < data.size() ? data.substr(off, size) : std::string();
+      return extent_protocol::OK;
+    }
   }
+  im->read_range(id, off, size, buf);
 
   return extent_protocol::OK;
 }
 
+int extent_server::write_range(extent_protocol::extentid_t id,
+                               chfs_command::txid_t txid, uint32_t off,
+                               std::string buf, int &) {
+  id &= 0x7fffffff;
+  tx_op op(this, txid);
+  if (!op.ok) {
+    return extent_protocol::IOERR;
+  }
+  if (off > im->max_file_size() || buf.size() > im->max_file_size() - off) {
+    return extent_protocol::FBIG;
+  }
+
+  std::unique_lock<std::mutex> fl(file_lock(id));
+  if (!patch_range(id, off, buf)) {
+    return extent_protocol::NOSPC;
+  }
+  auto data = std::string(sizeof(off), 0);
+  memcpy(&data[0], &off, sizeof(off));
+  data.append(buf);
+  _persister->append_log({txid, chfs_command::cmd_type::CMD_WRITE,
+                          static_cast<uint32_t>(id), data});
+  op.changed(id);
+
+  return extent_protocol::OK;
+}
+
+/* Apply a write_range: patch a held-back file in memory, or write the
+ * blocks. A write that would leave a gap in the held copy, or grow it past
+ * what can be held, writes the file back first. Return false, with the
+ * file unchanged, if the disk is full. */
+bool extent_server::patch_range(extent_protocol::extentid_t id, uint32_t off,
+                                const std::string &buf) {
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    auto it = dirty_.find(id);
+    if (it != dirty_.end()) {
+      auto &f = it->second;
+      auto end = off + buf.size();
+      auto grow = end > f.data.size() ? end - f.data.size() : 0;
+      if (off <= f.data.size() && (grow == 0 || can_hold(grow, 0))) {
+        f.data.resize(f.data.size() + grow);
+        f.data.replace(off, buf.size(), buf);
+        f.mtime = time(nullptr);
+        dirty_bytes_ += grow;
+        return true;
+      }
+      if (!release(id)) {
+        return false;
+      }
+    }
+  }
+  return im->write_range(id, off, buf.data(), buf.size());
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id,
+                            chfs_command::txid_t txid, uint32_t size, int &) {
+  id &= 0x7fffffff;
+  tx_op op(this, txid);
+  if (!op.ok) {
+    return extent_protocol::IOERR;
+  }
+  if (size > im->max_file_size()) {
+    return extent_protocol::FBIG;
+  }
+
+  std::unique_lock<std::mutex> fl(file_lock(id));
+  if (!resize(id, size)) {
+    return extent_protocol::NOSPC;
+  }
+  auto data = std::string(sizeof(size), 0);
+  memcpy(&data[0], &size, sizeof(size));
+  _persister->append_log({txid, chfs_command::cmd_type::CMD_TRUNCATE,
+                          static_cast<uint32_t>(id), data});
+  op.changed(id);
+
+  return extent_protocol::OK;
+}
+
+/* Apply a truncate: shrink the held-back copy of a file if there is one.
+ * Growing a held file writes it back first, so the new tail is a hole on
+ * disk rather than zeros in memory. Return false, with the file unchanged,
+ * if the disk is full. */
+bool extent_server::resize(extent_protocol::extentid_t id, uint32_t size) {
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    auto it = dirty_.find(id);
+    if (it != dirty_.end()) {
+      auto &f = it->second;
+      if (size <= f.data.size()) {
+        dirty_bytes_ -= f.data.size() - size;
+        f.data.resize(size);
+        f.mtime = time(nullptr);
+        return true;
+      }
+      if (!release(id)) {
+        return false;
+      }
+    }
+  }
+  return im->truncate(id, size);
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id,
                            extent_protocol::attr &a) {
   id &= 0x7fffffff;
@@ -137,40 +828,255 @@ int extent_server::getattr(extent_protocol::extentid_t id,
   extent_protocol::attr attr{};
   memset(&attr, 0, sizeof(attr));
   im->get_attr(id, attr);
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    auto it = dirty_.find(id);
+    if (it != dirty_.end()) {
+      attr.size = it->second.data.size();
+      attr.mtime = it->second.mtime;
+      attr.ctime = it->second.mtime;
+    }
+  }
   a = attr;
 
   return extent_protocol::OK;
 }
 
+/* Remove a file and drop any of its held back data. dirty_m_ is held
+ * throughout, so the data is dropped only if the file is gone. Fails with
+ * NOSPC, not logged, if a snapshot needs copies of the inode blocks and
+ * the disk has no room for them. */
 int extent_server::remove(extent_protocol::extentid_t id,
                           chfs_command::txid_t txid, int &) {
   id &= 0x7fffffff;
+  tx_op op(this, txid);
+  if (!op.ok) {
+    return extent_protocol::IOERR;
+  }
 
+  std::unique_lock<std::mutex> fl(file_lock(id));
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    if (!im->remove_file(id)) {
+      return extent_protocol::NOSPC;
+    }
+    auto it = dirty_.find(id);
+    if (it != dirty_.end()) {
+      dirty_bytes_ -= it->second.data.size();
+      dirty_.erase(it);
+    }
+  }
   _persister->append_log({txid,
                           chfs_command::cmd_type::CMD_REMOVE,
                           static_cast<uint32_t>(id),
                           {}});
+  op.changed(id);
 
-  im->remove_file(id);
+  return extent_protocol::OK;
+}
+
+/* Make dst a copy of src that shares its blocks, so no data is moved.
+ * Held back put data of src is written out first, and any of dst is
+ * dropped. dirty_m_ is held throughout, so a write_back cannot put dst's
+ * old data over the clone. */
+int extent_server::clone(extent_protocol::extentid_t src,
+                         extent_protocol::extentid_t dst,
+                         chfs_command::txid_t txid, int &) {
+  src &= 0x7fffffff;
+  dst &= 0x7fffffff;
+  tx_op op(this, txid);
+  if (!op.ok) {
+    return extent_protocol::IOERR;
+  }
+
+  // Lock in address order, as inode_manager::clone does.
+  auto &src_lock = file_lock(src);
+  auto &dst_lock = file_lock(dst);
+  std::unique_lock<std::mutex> l1(*std::min(&src_lock, &dst_lock));
+  std::unique_lock<std::mutex> l2;
+  if (&src_lock != &dst_lock) {
+    l2 = std::unique_lock<std::mutex>(*std::max(&src_lock, &dst_lock));
+  }
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    auto it = dirty_.find(src);
+    if (it != dirty_.end()) {
+      if (!im->write_file(src, it->second.data.data(),
+                          it->second.data.size())) {
+        return extent_protocol::NOSPC;
+      }
+      dirty_bytes_ -= it->second.data.size();
+      dirty_.erase(it);
+    }
+    if (!im->clone(src, dst)) {
+      extent_protocol::attr a{}, b{};
+      im->get_attr(src, a);
+      im->get_attr(dst, b);
+      return a.type == 0 || b.type == 0 ? extent_protocol::NOENT
+                                         : extent_protocol::NOSPC;
+    }
+    it = dirty_.find(dst);
+    if (it != dirty_.end()) {
+      dirty_bytes_ -= it->second.data.size();
+      dirty_.erase(it);
+    }
+  }
+  auto data = std::string(sizeof(uint32_t), 0);
+  auto from = static_cast<uint32_t>(src);
+  memcpy(&data[0], &from, sizeof(from));
+  _persister->append_log({txid, chfs_command::cmd_type::CMD_CLONE,
+                          static_cast<uint32_t>(dst), data});
+  op.changed(dst);
 
   return extent_protocol::OK;
 }
 
 extent_protocol::status extent_server::start_tx(int ignore,
                                                 chfs_command::txid_t &txid) {
-  txid = ++txid_;
+  txid = open_tx();
   _persister->append_log({txid, chfs_command::cmd_type::CMD_BEGIN, 0, {}});
   return extent_protocol::OK;
 }
 
 extent_protocol::status extent_server::commit_tx(chfs_command::txid_t txid,
                                                  int &ignore) {
-  _persister->append_log({txid, chfs_command::cmd_type::CMD_COMMIT, 0, {}});
-  _persister->checkpoint();
+  {
+    // A checkpoint may have aborted it for taking too long.
+    std::unique_lock<std::mutex> l(tx_m_);
+    if (open_.count(txid) == 0) {
+      return extent_protocol::IOERR;
+    }
+    _persister->append_log({txid, chfs_command::cmd_type::CMD_COMMIT, 0, {}});
+    for (auto it = unsettled_.begin(); it != unsettled_.end();) {
+      it = it->second == txid ? unsettled_.erase(it) : std::next(it);
+    }
+  }
+  // The commit is durable once its records are in the log; concurrent
+  // commits share one write and fdatasync.
+  bool durable = _persister->sync_log();
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    write_back();
+  }
+  close_tx(txid);
+  if (!durable) {
+    return extent_protocol::IOERR;
+  }
+  if (_persister->lsn() - checkpoint_lsn_ >= CHECKPOINT_LOG_BYTES ||
+      im->cache().dirty() >= CHECKPOINT_DIRTY_BLOCKS) {
+    std::unique_lock<std::mutex> l(checkpoint_m_);
+    checkpoint_wanted_ = true;
+    checkpoint_cv_.notify_one();
+  }
   return extent_protocol::OK;
 }
 extent_protocol::status extent_server::abort_tx(chfs_command::txid_t txid,
                                                 int &ignore) {
   _persister->append_log({txid, chfs_command::cmd_type::CMD_ABORT, 0, {}});
+  close_tx(txid);
+  return extent_protocol::OK;
+}
+
+/* Report the disk layout and cache behaviour as "name value" lines. The
+ * fragmentation ratio is the share of files with blocks that are split
+ * over more than one disk run. */
+extent_protocol::status extent_server::stats(int, std::string &out) {
+  layout_stats st;
+  im->layout(st);
+  const auto &cache = im->cache();
+  std::ostringstream os;
+  os << "files " << st.files << "\n";
+  os << "fragmented_files " << st.fragmented << "\n";
+  os << "fragmentation "
+     << (st.files != 0 ? double(st.fragmented) / st.files : 0.0) << "\n";
+  os << "disk_runs " << st.runs << "\n";
+  os << "data_blocks " << st.blocks << "\n";
+  os << "free_blocks " << st.free << "\n";
+  os << "relocated_files " << relocated_files_ << "\n";
+  os << "relocated_blocks " << relocated_blocks_ << "\n";
+  os << "cache_hits " << cache.hits() << "\n";
+  os << "cache_misses " << cache.misses() << "\n";
+  os << "cache_dirty " << cache.dirty() << "\n";
+  os << "checkpoints " << checkpoints_ << "\n";
+  os << "log_bytes " << _persister->log_bytes() << "\n";
+  out = os.str();
+  return extent_protocol::OK;
+}
+
+/* Take a snapshot of the file system as the last writes left it. Held back
+ * put data is written first so the snapshot sees it. Like any other
+ * change it is logged, then reaches the image through a checkpoint, taken
+ * right away. Replaying the log takes the snapshot again unless the image
+ * already has it. */
+extent_protocol::status extent_server::snapshot_create(int, uint32_t &id) {
+  auto txid = open_tx();
+  {
+    std::unique_lock<std::mutex> l(dirty_m_);
+    write_back();
+    id = im->snapshot();
+  }
+  if (id == 0) {
+    close_tx(txid);
+    return extent_protocol::IOERR;
+  }
+  auto data = std::string(sizeof(id), 0);
+  memcpy(&data[0], &id, sizeof(id));
+  _persister->append_log({txid, chfs_command::cmd_type::CMD_BEGIN, 0, {}});
+  _persister->append_log(
+      {txid, chfs_command::cmd_type::CMD_SNAPSHOT, 0, data});
+  _persister->append_log({txid, chfs_command::cmd_type::CMD_COMMIT, 0, {}});
+  bool durable = _persister->sync_log();
+  close_tx(txid);
+  if (!durable) {
+    return extent_protocol::IOERR;
+  }
+  // The log holds the snapshot now; a checkpoint moves it into the image.
+  checkpoint();
+  return extent_protocol::OK;
+}
+
+/* Delete snapshot id, freeing the blocks only it kept. Logged and
+ * checkpointed like snapshot_create; replaying it deletes the snapshot
+ * again unless the image is already without it. */
+extent_protocol::status extent_server::snapshot_delete(uint32_t id, int &) {
+  auto txid = open_tx();
+  if (!im->delete_snapshot(id)) {
+    close_tx(txid);
+    return extent_protocol::NOENT;
+  }
+  auto data = std::string(sizeof(id), 0);
+  memcpy(&data[0], &id, sizeof(id));
+  _persister->append_log({txid, chfs_command::cmd_type::CMD_BEGIN, 0, {}});
+  _persister->append_log(
+      {txid, chfs_command::cmd_type::CMD_SNAPSHOT_DELETE, 0, data});
+  _persister->append_log({txid, chfs_command::cmd_type::CMD_COMMIT, 0, {}});
+  bool durable = _persister->sync_log();
+  close_tx(txid);
+  if (!durable) {
+    return extent_protocol::IOERR;
+  }
+  checkpoint();
+  return extent_protocol::OK;
+}
+
+/* List the snapshots, oldest first, as "id time" lines. */
+extent_protocol::status extent_server::snapshot_list(int, std::string &out) {
+  std::vector<snapshot_t> snaps;
+  im->list_snapshots(snaps);
+  std::ostringstream os;
+  for (const auto &s : snaps) {
+    os << s.id << " " << s.time << "\n";
+  }
+  out = os.str();
+  return extent_protocol::OK;
+}
+
+extent_protocol::status extent_server::snapshot_get(
+    uint32_t snap, extent_protocol::extentid_t id, std::string &buf) {
+  id &= 0x7fffffff;
+
+  if (!im->read_snapshot(snap, id, buf)) {
+    return extent_protocol::NOENT;
+  }
   return extent_protocol::OK;
 }
@@ -1,32 +1,196 @@
 // this is the extent server
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "extent_protocol.h"
 #include "inode_manager.h"
 #include "persister.h"
 
+// Bytes of put data held back from the disk before it is written early.
+#define DIRTY_LIMIT (8 * 1024 * 1024)
+// Default pause between two background defragmentation steps.
+#define DEFRAG_INTERVAL_MS 200
+// Inodes a defragmentation step looks at for a fragmented file.
+#define DEFRAG_SCAN 64
+// A checkpoint is taken this often, or sooner once this many log bytes were
+// written since the last one or this many cached blocks are dirty.
+#define CHECKPOINT_INTERVAL_MS 1000
+#define CHECKPOINT_LOG_BYTES (4 * 1024 * 1024)
+#define CHECKPOINT_DIRTY_BLOCKS (CACHE_BLOCKS / 2)
+// How long a checkpoint waits for the transactions in progress to finish
+// before it gives up until the next one.
+#define CHECKPOINT_QUIESCE_MS 200
+// A transaction open this long is taken for one whose client died, and a
+// checkpoint aborts it instead of waiting for it.
+#define TX_TIMEOUT_MS 10000
+// Where the disk is checkpointed to unless an image is given.
+#define CHECKPOINT_IMAGE "log/checkpoint.img"
+// Threads at most that replay the log at startup.
+#define RECOVERY_THREADS 8
+
 class extent_server {
  protected:
   inode_manager *im;
   chfs_persister *_persister;
-  chfs_command::txid_t txid_;
+  std::atomic<chfs_command::txid_t> txid_;
+
+  // Contents stored by put that have no blocks yet. They are written at
+  // commit, or earlier once DIRTY_LIMIT bytes are held, so a file rewritten
+  // many times in between is allocated and written once. A held file only
+  // grows by the bytes written to it: one written past its end or grown by
+  // a truncate is written back first and changed on disk, where the gap
+  // is a hole.
+  struct dirty_file {
+    std::string data;
+    unsigned int mtime;
+  };
+  std::mutex dirty_m_;
+  std::unordered_map<extent_protocol::extentid_t, dirty_file> dirty_;
+  size_t dirty_bytes_;
+  // Striped per-file locks. A handler changing a file holds its lock from
+  // reading what it builds on until the change is logged and applied, so
+  // the log orders the changes to a file as they were made. Taken before
+  // dirty_m_, which write_back holds while the inode manager takes its own
+  // inode locks.
+  std::unique_ptr<std::mutex[]> flocks_;
+
+  std::mutex &file_lock(extent_protocol::extentid_t id) {
+    return flocks_[id % NINODE_LOCKS];
+  }
+
+  // Transactions in progress, with the time each started, and the number
+  // of handlers running for them. A checkpoint holds new transactions back
+  // and waits for these to finish, so the image it writes holds none of
+  // their work.
+  std::mutex tx_m_;
+  std::condition_variable tx_cv_;
+  std::map<chfs_command::txid_t, std::chrono::steady_clock::time_point> open_;
+  size_t busy_;
+  bool tx_held_;
+
+  // Files last changed by a transaction that has not committed, with its
+  // id. Replay skips that change unless the transaction commits, so a put
+  // logs a delta only against contents it does not depend on: a file not
+  // in here, or one its own transaction changed.
+  std::unordered_map<uint32_t, chfs_command::txid_t> unsettled_;
+
+  // A handler changing files on behalf of transaction txid, counted in
+  // busy_ while it runs. ok is false, and the handler must fail without
+  // changing anything, if the transaction is not open: a checkpoint may
+  // have aborted it. Replay runs with txid 0 and is always let through.
+  struct tx_op {
+    extent_server *es;
+    chfs_command::txid_t txid;
+    bool ok;
+    tx_op(extent_server *server, chfs_command::txid_t txid);
+    ~tx_op();
+    // Note that the handler changed file id.
+    void changed(extent_protocol::extentid_t id);
+    // Whether replay rebuilds file id as it is now from committed records
+    // and this transaction's own.
+    bool settled(extent_protocol::extentid_t id);
+  };
+
+  chfs_command::txid_t open_tx();
+  void close_tx(chfs_command::txid_t txid);
+  bool quiesce();
+  void resume();
+
+  void write_back();
+  bool can_hold(size_t more, size_t files);
+  bool release(extent_protocol::extentid_t id);
+  void recover(std::set<chfs_command::txid_t> &unfinished);
+  size_t replay_segment(const std::vector<const log_record *> &segment);
+  void replay(const log_record &r);
+  void contents(extent_protocol::extentid_t id, std::string &buf);
+  bool store(extent_protocol::extentid_t id, std::string buf);
+  bool patch_range(extent_protocol::extentid_t id, uint32_t off,
+                   const std::string &buf);
+  bool resize(extent_protocol::extentid_t id, uint32_t size);
+
+  // Background defragmentation. Each step moves at most one fragmented
+  // file into a contiguous run, as a transaction of its own, then sleeps,
+  // so foreground requests keep most of the disk.
+  std::thread defrag_thread_;
+  std::mutex defrag_m_;
+  std::condition_variable defrag_cv_;
+  bool defrag_stop_;
+  uint32_t defrag_cursor_;
+  std::atomic<uint64_t> relocated_files_;
+  std::atomic<uint64_t> relocated_blocks_;
+
+  bool defrag_step();
+  void defrag_loop(unsigned interval_ms);
+
+  // Background checkpoints, once start_checkpoint runs them. Commits only
+  // make their log records durable; this thread writes the disk image out
+  // and drops the finished part of the log, so commit latency does not
+  // grow with the log.
+  std::thread checkpoint_thread_;
+  std::mutex checkpoint_m_;
+  std::condition_variable checkpoint_cv_;
+  bool checkpoint_stop_;
+  bool checkpoint_wanted_;
+  // Held for the whole of a checkpoint, which snapshot_create takes too.
+  std::mutex checkpoint_run_m_;
+  // Log position the last checkpoint covered.
+  std::atomic<uint64_t> checkpoint_lsn_;
+  std::atomic<uint64_t> checkpoints_;
+
+  void checkpoint();
+  void checkpoint_loop(unsigned interval_ms);
 
  public:
-  extent_server();
+  explicit extent_server(uint32_t block_size = BLOCK_SIZE,
+                         uint64_t disk_size = DISK_SIZE,
+                         uint32_t ninodes = INODE_NUM,
+                         enum atime_mode atime = ATIME_RELATIME,
+                         const std::string &image = "");
+  ~extent_server();
+  void start_defrag(unsigned interval_ms = DEFRAG_INTERVAL_MS);
+  void stop_defrag();
+  void start_checkpoint(unsigned interval_ms = CHECKPOINT_INTERVAL_MS);
+  void stop_checkpoint();
   extent_protocol::status create(uint32_t type, chfs_command::txid_t txid,
                                  extent_protocol::extentid_t &);
   extent_protocol::status occupy(extent_protocol::extentid_t, uint32_t type);
   extent_protocol::status put(extent_protocol::extentid_t, chfs_command::txid_t,
                               std::string, int &ignore);
   extent_protocol::status get(extent_protocol::extentid_t, std::string &);
+  extent_protocol::status read_range(extent_protocol::extentid_t, uint32_t off,
+                                     uint32_t size, std::string &);
+  extent_protocol::status write_range(extent_protocol::extentid_t,
+                                      chfs_command::txid_t, uint32_t off,
+                                      std::string, int &ignore);
+  extent_protocol::status truncate(extent_protocol::extentid_t,
+                                   chfs_command::txid_t, uint32_t size,
+                                   int &ignore);
   extent_protocol::status getattr(extent_protocol::extentid_t,
                                   extent_protocol::attr &);
   extent_protocol::status remove(extent_protocol::extentid_t id,
                                  chfs_command::txid_t txid, int &ignore);
+  extent_protocol::status clone(extent_protocol::extentid_t src,
+                                extent_protocol::extentid_t dst,
+                                chfs_command::txid_t txid, int &ignore);
   extent_protocol::status start_tx(int ignore, chfs_command::txid_t &txid);
   extent_protocol::status commit_tx(chfs_command::txid_t txid, int &ignore);
   extent_protocol::status abort_tx(chfs_command::txid_t txid, int &ignore);
+  extent_protocol::status stats(int ignore, std::string &);
+  extent_protocol::status snapshot_create(int ignore, uint32_t &id);
+  extent_protocol::status snapshot_delete(uint32_t id, int &ignore);
+  extent_protocol::status snapshot_list(int ignore, std::string &);
+  extent_protocol::status snapshot_get(uint32_t snap,
+                                       extent_protocol::extentid_t,
+                                       std::string &);
 };
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "extent_server.h"
@@ -23,8 +24,63 @@ int main(int argc, char *argv[]) {
     count = atoi(count_env);
   }
 
+  // Disk geometry, fixed when the disk is formatted.
+  uint32_t block_size = BLOCK_SIZE;
+  uint64_t disk_size = DISK_SIZE;
+  uint32_t ninodes = INODE_NUM;
+  char *block_size_env = getenv("CHFS_BLOCK_SIZE");
+  if (block_size_env != NULL) {
+    block_size = strtoul(block_size_env, NULL, 0);
+  }
+  char *disk_size_env = getenv("CHFS_DISK_SIZE");
+  if (disk_size_env != NULL) {
+    disk_size = strtoull(disk_size_env, NULL, 0);
+  }
+  char *inode_num_env = getenv("CHFS_INODE_NUM");
+  if (inode_num_env != NULL) {
+    ninodes = strtoul(inode_num_env, NULL, 0);
+  }
+
+  // Access time policy: strict, relatime (default) or noatime.
+  enum atime_mode atime = ATIME_RELATIME;
+  char *atime_env = getenv("CHFS_ATIME");
+  if (atime_env != NULL) {
+    if (strcmp(atime_env, "strict") == 0) {
+      atime = ATIME_STRICT;
+    } else if (strcmp(atime_env, "noatime") == 0) {
+      atime = ATIME_NOATIME;
+    } else if (strcmp(atime_env, "relatime") != 0) {
+      printf("Unknown CHFS_ATIME %s\n", atime_env);
+      exit(1);
+    }
+  }
+
+  // Checkpoint the disk to this image file instead of CHECKPOINT_IMAGE.
+  std::string image;
+  char *image_env = getenv("CHFS_IMAGE");
+  if (image_env != NULL) {
+    image = image_env;
+  }
+
+  // Pause between background defragmentation steps; 0 turns it off.
+  unsigned defrag_ms = DEFRAG_INTERVAL_MS;
+  char *defrag_env = getenv("CHFS_DEFRAG_MS");
+  if (defrag_env != NULL) {
+    defrag_ms = strtoul(defrag_env, NULL, 0);
+  }
+
+  // Pause between background checkpoints; 0 leaves only the log and cache
+  // thresholds to trigger them.
+  unsigned checkpoint_ms = CHECKPOINT_INTERVAL_MS;
+  char *checkpoint_env = getenv("CHFS_CHECKPOINT_MS");
+  if (checkpoint_env != NULL) {
+    checkpoint_ms = strtoul(checkpoint_env, NULL, 0);
+  }
+
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(block_size, disk_size, ninodes, atime, image);
+  ls.start_defrag(defrag_ms);
+  ls.start_checkpoint(checkpoint_ms);
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
@@ -34,6 +90,18 @@ int main(int argc, char *argv[]) {
   server.reg(extent_protocol::start_tx, &ls, &extent_server::start_tx);
   server.reg(extent_protocol::abort_tx, &ls, &extent_server::abort_tx);
   server.reg(extent_protocol::commit_tx, &ls, &extent_server::commit_tx);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::clone, &ls, &extent_server::clone);
+  server.reg(extent_protocol::stats, &ls, &extent_server::stats);
+  server.reg(extent_protocol::snapshot_create, &ls,
+             &extent_server::snapshot_create);
+  server.reg(extent_protocol::snapshot_delete, &ls,
+             &extent_server::snapshot_delete);
+  server.reg(extent_protocol::snapshot_list, &ls,
+             &extent_server::snapshot_list);
+  server.reg(extent_protocol::snapshot_get, &ls, &extent_server::snapshot_get);
 
   while (1) {
     sleep(1000);
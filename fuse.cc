@@ -133,9 +133,15 @@ void fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
     st.st_size = attr->st_size;
 
     chfs->acquire(ino);
-    chfs->setattr(ino, attr->st_size);
+    auto ret = chfs->setattr(ino, attr->st_size);
     chfs->release(ino);
 
+    if (ret != chfs_client::OK) {
+      fuse_reply_err(req, ret == chfs_client::NOSPC  ? ENOSPC
+                          : ret == chfs_client::FBIG ? EFBIG
+                                                     : EIO);
+      return;
+    }
     getattr(ino, st);
     fuse_reply_attr(req, &st, 0);
 
@@ -195,7 +201,9 @@ void fuseserver_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
   chfs->release(ino);
 
   if (ret != chfs_client::OK) {
-    fuse_reply_err(req, EIO);
+    fuse_reply_err(req, ret == chfs_client::NOSPC  ? ENOSPC
+                        : ret == chfs_client::FBIG ? EFBIG
+                                                   : EIO);
   } else {
     fuse_reply_write(req, aw);
   }
@@ -255,6 +263,8 @@ void fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
   } else {
     if (ret == chfs_client::EXIST) {
       fuse_reply_err(req, EEXIST);
+    } else if (ret == chfs_client::NOSPC) {
+      fuse_reply_err(req, ENOSPC);
     } else {
       fuse_reply_err(req, ENOENT);
     }
@@ -276,6 +286,8 @@ void fuseserver_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
   } else {
     if (ret == chfs_client::EXIST) {
       fuse_reply_err(req, EEXIST);
+    } else if (ret == chfs_client::NOSPC) {
+      fuse_reply_err(req, ENOSPC);
     } else {
       fuse_reply_err(req, ENOENT);
     }
@@ -417,7 +429,7 @@ void fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
   } else {
     chfs->release(parent);
 
-    fuse_reply_err(req, EEXIST);
+    fuse_reply_err(req, ret == chfs_client::NOSPC ? ENOSPC : EEXIST);
   }
 }
 
@@ -438,6 +450,8 @@ void fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
   } else {
     if (ret == chfs_client::NOENT) {
       fuse_reply_err(req, ENOENT);
+    } else if (ret == chfs_client::NOSPC) {
+      fuse_reply_err(req, ENOSPC);
     } else {
       fuse_reply_err(req, ENOTEMPTY);
     }
@@ -484,7 +498,7 @@ void fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
   } else {
     chfs->release(parent);
 
-    fuse_reply_err(req, EEXIST);
+    fuse_reply_err(req, ret == chfs_client::NOSPC ? ENOSPC : EEXIST);
   }
 }
 
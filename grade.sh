@@ -296,5 +296,16 @@ rm tmp.0
 #echo "Passed all tests!"
 
 ./stop.sh
+
+##################################################################################
+# The recovery test runs an extent server of its own, killing and
+# restarting it, so it comes after the mounted file systems are gone.
+./test-lab2b-recovery.sh 2>&1 | grep -q "Passed RECOVERY TEST"
+if [ $? -ne 0 ];
+then
+        echo "Failed RECOVERY test"
+else
+        echo "Passed RECOVERY test"
+fi
 echo ""
 echo "Score: "$score"/100"
\ No newline at end of file
@@ -1,345 +1,2344 @@
 #include "inode_manager.h"
 
-#include <deque>
-#include <queue>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "crc32c.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 // disk layer -----------------------------------------
 
-disk::disk() : blocks() { bzero(blocks, sizeof(blocks)); }
+#define JOURNAL_MAGIC 0x63686a31  // "chj1"
+
+// Head of a disk journal. The ids of count blocks follow, then their
+// contents.
+struct journal_header {
+  uint32_t magic;
+  uint32_t count;
+  // CRC32C of the ids and contents.
+  uint32_t crc;
+  uint32_t pad;
+};
+
+static bool read_all(int fd, void *buf, uint64_t n, uint64_t off) {
+  auto *p = static_cast<char *>(buf);
+  for (uint64_t done = 0; done < n;) {
+    auto r = pread(fd, p + done, n - done, off + done);
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    done += r;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *buf, uint64_t n, uint64_t off) {
+  auto *p = static_cast<const char *>(buf);
+  for (uint64_t done = 0; done < n;) {
+    auto w = pwrite(fd, p + done, n - done, off + done);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return false;
+    }
+    done += w;
+  }
+  return true;
+}
+
+// Make the creation or renaming of file path durable.
+static bool sync_dir(const std::string &path) {
+  auto slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "."
+                    : slash == 0               ? "/"
+                                               : path.substr(0, slash);
+  int dfd = open(dir.c_str(), O_RDONLY);
+  if (dfd < 0) {
+    return false;
+  }
+  bool ok = fsync(dfd) == 0;
+  close(dfd);
+  return ok;
+}
+
+// Without an image the disk is a plain in-memory array: calloc hands back
+// lazily zeroed pages, so it holds every block ever written, up to the
+// disk size, and nothing else. An image file is mapped privately, so the
+// file itself only changes when save() writes the blocks changed since
+// back to it, at a checkpoint; a missing image is mapped from a sparse
+// file that the first save() renames into place. Written pages are
+// private copies until release() hands them back after a save, so the
+// memory held beyond the page cache is bounded by the blocks written
+// since the last checkpoint.
+disk::disk(uint32_t block_size, uint32_t nblocks, const std::string &image)
+    : block_size(block_size),
+      size(uint64_t(nblocks) * block_size),
+      fd(-1),
+      existed(false),
+      image(image),
+      journal_(-1),
+      new_(-1) {
+  if (image.empty()) {
+    blocks = static_cast<unsigned char *>(calloc(nblocks, block_size));
+    return;
+  }
+  dirty_.reset(new std::atomic<uint64_t>[(nblocks + 63) / 64]());
+  auto journal = image + ".journal";
+  journal_ = open(journal.c_str(), O_RDWR | O_CREAT, 0644);
+  if (journal_ < 0 || !sync_dir(journal)) {
+    printf("\tdisk: error! cannot open journal %s\n", journal.c_str());
+    exit(1);
+  }
+  fd = open(image.c_str(), O_RDWR);
+  struct stat st;
+  if (fd < 0 && errno == ENOENT) {
+    // A journal left without its image belongs to no image at all.
+    if (ftruncate(journal_, 0) != 0 || fdatasync(journal_) != 0) {
+      printf("\tdisk: error! cannot clear journal %s\n", journal.c_str());
+      exit(1);
+    }
+    map_new();
+    return;
+  }
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("\tdisk: error! cannot open image %s\n", image.c_str());
+    exit(1);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    fd = -1;
+    map_new();
+    return;
+  }
+  if (uint64_t(st.st_size) != size) {
+    printf("\tdisk: error! image %s is %lu bytes, expected %lu\n",
+           image.c_str(), static_cast<unsigned long>(st.st_size),
+           static_cast<unsigned long>(size));
+    exit(1);
+  }
+  redo_journal();
+  map(fd);
+  existed = true;
+}
+
+// Map the disk privately from file f.
+void disk::map(int f) {
+  void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f, 0);
+  if (p == MAP_FAILED) {
+    printf("\tdisk: error! cannot map image %s\n", image.c_str());
+    exit(1);
+  }
+  blocks = static_cast<unsigned char *>(p);
+}
+
+// Start a new image as a zeroed sparse file next to its final name, mapped
+// like an existing one.
+void disk::map_new() {
+  auto tmp = image + ".tmp";
+  new_ = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (new_ < 0 || ftruncate(new_, size) != 0) {
+    printf("\tdisk: error! cannot create image %s\n", tmp.c_str());
+    exit(1);
+  }
+  map(new_);
+}
+
+// Note count blocks from id as changed since the last take_dirty().
+void disk::mark(blockid_t id, uint32_t count) {
+  if (!dirty_) {
+    return;
+  }
+  for (auto i = id; i < id + count; ++i) {
+    dirty_[i / 64].fetch_or(1ULL << (i % 64));
+  }
+}
+
+// Copy every block changed since the last call into u and start over.
+// Nothing may write the disk meanwhile.
+void disk::take_dirty(disk_update &u) {
+  if (!dirty_) {
+    return;
+  }
+  auto nwords = (size / block_size + 63) / 64;
+  for (uint64_t w = 0; w < nwords; ++w) {
+    if (dirty_[w].load() == 0) {
+      continue;
+    }
+    auto bits = dirty_[w].exchange(0);
+    for (; bits != 0; bits &= bits - 1) {
+      u.ids.push_back(w * 64 + __builtin_ctzll(bits));
+    }
+  }
+  u.data.resize(uint64_t(u.ids.size()) * block_size);
+  for (size_t k = 0; k < u.ids.size(); ++k) {
+    memcpy(&u.data[k * block_size], blocks + uint64_t(u.ids[k]) * block_size,
+           block_size);
+  }
+}
+
+// Write the blocks of u to file out where they belong, a run of
+// consecutive ones at a time, and wait for them.
+static bool write_update(int out, const disk_update &u, uint32_t block_size) {
+  for (size_t k = 0; k < u.ids.size();) {
+    auto n = size_t(1);
+    while (k + n < u.ids.size() && u.ids[k + n] == u.ids[k] + n) {
+      ++n;
+    }
+    if (!write_all(out, &u.data[k * block_size], uint64_t(n) * block_size,
+                   uint64_t(u.ids[k]) * block_size)) {
+      return false;
+    }
+    k += n;
+  }
+  return fdatasync(out) == 0;
+}
+
+// Finish a save() cut short by a crash. A complete journal holds blocks
+// that may have reached the image only in part, so they are written again;
+// a torn one was never acted on and is dropped.
+void disk::redo_journal() {
+  struct stat st;
+  journal_header h;
+  if (fstat(journal_, &st) != 0 || uint64_t(st.st_size) < sizeof(h) ||
+      !read_all(journal_, &h, sizeof(h), 0) || h.magic != JOURNAL_MAGIC ||
+      uint64_t(st.st_size) !=
+          sizeof(h) + uint64_t(h.count) * (sizeof(blockid_t) + block_size)) {
+    return;
+  }
+  disk_update u;
+  u.ids.resize(h.count);
+  u.data.resize(uint64_t(h.count) * block_size);
+  auto ids_bytes = uint64_t(h.count) * sizeof(blockid_t);
+  if (!read_all(journal_, u.ids.data(), ids_bytes, sizeof(h)) ||
+      !read_all(journal_, u.data.data(), u.data.size(),
+                sizeof(h) + ids_bytes) ||
+      crc32c_extend(crc32c(u.ids.data(), ids_bytes), u.data.data(),
+                    u.data.size()) != h.crc) {
+    return;
+  }
+  for (auto id : u.ids) {
+    if (uint64_t(id) * block_size >= size) {
+      return;
+    }
+  }
+  if (!write_update(fd, u, block_size) || ftruncate(journal_, 0) != 0) {
+    printf("\tdisk: error! cannot redo journal of image %s\n", image.c_str());
+    exit(1);
+  }
+}
+
+// Bring the image up to date with u, blocks taken by take_dirty(). A new
+// image gets the blocks written to the file it is mapped from, which is
+// then renamed over its final name. After
+// that blocks are overwritten in place, journaled first, so a crash leaves
+// the image as it was before or, once redo_journal() ran, after.
+void disk::save(const disk_update &u) {
+  if (image.empty()) {
+    return;
+  }
+  if (fd < 0) {
+    auto tmp = image + ".tmp";
+    if (!write_update(new_, u, block_size) ||
+        rename(tmp.c_str(), image.c_str()) != 0 || !sync_dir(image)) {
+      printf("\tdisk: error! cannot write image %s\n", image.c_str());
+      exit(1);
+    }
+    fd = new_;
+    new_ = -1;
+    return;
+  }
+  if (u.ids.empty()) {
+    return;
+  }
+  auto ids_bytes = uint64_t(u.ids.size()) * sizeof(blockid_t);
+  journal_header h{};
+  h.magic = JOURNAL_MAGIC;
+  h.count = u.ids.size();
+  h.crc = crc32c_extend(crc32c(u.ids.data(), ids_bytes), u.data.data(),
+                        u.data.size());
+  auto end = sizeof(h) + ids_bytes + u.data.size();
+  if (!write_all(journal_, &h, sizeof(h), 0) ||
+      !write_all(journal_, u.ids.data(), ids_bytes, sizeof(h)) ||
+      !write_all(journal_, u.data.data(), u.data.size(),
+                 sizeof(h) + ids_bytes) ||
+      ftruncate(journal_, end) != 0 || fdatasync(journal_) != 0 ||
+      !write_update(fd, u, block_size) || ftruncate(journal_, 0) != 0) {
+    printf("\tdisk: error! cannot write image %s\n", image.c_str());
+    exit(1);
+  }
+}
+
+// Blocks in each unit release() hands back: a page, or one block if
+// blocks are larger.
+uint32_t disk::release_unit() const {
+  return MAX(uint32_t(sysconf(_SC_PAGESIZE)), block_size) / block_size;
+}
+
+// Drop the private copy of the unit holding block id, so it is read from
+// the image again, unless one of its blocks changed since the last save.
+// Caller keeps its blocks from being written meanwhile.
+void disk::release(blockid_t id) {
+  if (!dirty_ || fd < 0) {
+    return;
+  }
+  auto n = release_unit();
+  auto first = id / n * n;
+  auto end = MIN(uint64_t(first) + n, size / block_size);
+  for (auto i = uint64_t(first); i < end; ++i) {
+    if (dirty_[i / 64].load() & (1ULL << (i % 64))) {
+      return;
+    }
+  }
+  madvise(blocks + uint64_t(first) * block_size, (end - first) * block_size,
+          MADV_DONTNEED);
+}
+
+void disk::read_block(blockid_t id, char *buf) {
+  memcpy(buf, blocks + uint64_t(id) * block_size, block_size);
+}
+
+void disk::write_block(blockid_t id, const char *buf) {
+  mark(id, 1);
+  memcpy(blocks + uint64_t(id) * block_size, buf, block_size);
+}
+
+void disk::read_blocks(blockid_t id, uint32_t count, char *buf) {
+  memcpy(buf, blocks + uint64_t(id) * block_size, uint64_t(count) * block_size);
+}
+
+void disk::write_blocks(blockid_t id, uint32_t count, const char *buf) {
+  mark(id, count);
+  memcpy(blocks + uint64_t(id) * block_size, buf, uint64_t(count) * block_size);
+}
+
+// Copy part of a block without staging the whole block.
+void disk::read_bytes(blockid_t id, uint32_t off, uint32_t n, char *buf) {
+  memcpy(buf, blocks + uint64_t(id) * block_size + off, n);
+}
+
+void disk::write_bytes(blockid_t id, uint32_t off, uint32_t n,
+                       const char *buf) {
+  mark(id, 1);
+  memcpy(blocks + uint64_t(id) * block_size + off, buf, n);
+}
+
+// block layer -----------------------------------------
+
+buffer_cache::buffer_cache(disk *d, uint32_t block_size, uint32_t nframes)
+    : d_(d),
+      block_size_(block_size),
+      shards_(new shard[NCACHE_SHARDS]),
+      hits_(0),
+      misses_(0),
+      dirty_(0) {
+  auto per_shard = MAX(nframes / NCACHE_SHARDS, 4u);
+  for (uint32_t i = 0; i < NCACHE_SHARDS; ++i) {
+    auto &s = shards_[i];
+    s.frames.assign(per_shard, frame());
+    s.data.resize(uint64_t(per_shard) * block_size / sizeof(uint64_t));
+    s.hand = 0;
+  }
+}
+
+char *buffer_cache::frame_data(shard &s, uint32_t f) {
+  return reinterpret_cast<char *>(s.data.data()) + uint64_t(f) * block_size_;
+}
+
+// Return the frame holding block id, reading it from the disk on a miss
+// unless the caller is about to overwrite all of it. The victim is picked
+// by CLOCK among unpinned frames and written back first if dirty. Caller
+// holds s.m.
+uint32_t buffer_cache::lookup(shard &s, blockid_t id, bool load) {
+  auto it = s.map.find(id);
+  if (it != s.map.end()) {
+    ++hits_;
+    s.frames[it->second].ref = true;
+    return it->second;
+  }
+  ++misses_;
+  auto n = static_cast<uint32_t>(s.frames.size());
+  for (uint32_t k = 0; k < 2 * n + 1; ++k, s.hand = (s.hand + 1) % n) {
+    auto &f = s.frames[s.hand];
+    if (f.valid && (f.pins != 0 || f.ref)) {
+      f.ref = f.pins != 0;
+      continue;
+    }
+    if (f.valid) {
+      if (f.dirty) {
+        d_->write_block(f.id, frame_data(s, s.hand));
+        --dirty_;
+      }
+      s.map.erase(f.id);
+    }
+    f.id = id;
+    f.valid = true;
+    f.dirty = false;
+    f.ref = true;
+    f.pins = 0;
+    if (load) {
+      d_->read_block(id, frame_data(s, s.hand));
+    }
+    s.map[id] = s.hand;
+    auto victim = s.hand;
+    s.hand = (s.hand + 1) % n;
+    return victim;
+  }
+  printf("\tcache: error! every frame is pinned\n");
+  exit(1);
+}
+
+// Pin block id in the cache and return its bytes, which stay valid until
+// the matching unpin.
+char *buffer_cache::pin(blockid_t id) {
+  auto &s = shard_of(id);
+  std::unique_lock<std::mutex> l(s.m);
+  auto f = lookup(s, id, true);
+  ++s.frames[f].pins;
+  return frame_data(s, f);
+}
+
+void buffer_cache::unpin(blockid_t id, bool dirty) {
+  auto &s = shard_of(id);
+  std::unique_lock<std::mutex> l(s.m);
+  auto &f = s.frames[s.map.at(id)];
+  --f.pins;
+  if (dirty && !f.dirty) {
+    f.dirty = true;
+    ++dirty_;
+  }
+}
+
+void buffer_cache::read(blockid_t id, uint32_t off, uint32_t n, char *buf) {
+  auto &s = shard_of(id);
+  std::unique_lock<std::mutex> l(s.m);
+  memcpy(buf, frame_data(s, lookup(s, id, true)) + off, n);
+}
+
+void buffer_cache::write(blockid_t id, uint32_t off, uint32_t n,
+                         const char *buf) {
+  auto &s = shard_of(id);
+  std::unique_lock<std::mutex> l(s.m);
+  auto f = lookup(s, id, off != 0 || n != block_size_);
+  memcpy(frame_data(s, f) + off, buf, n);
+  if (!s.frames[f].dirty) {
+    s.frames[f].dirty = true;
+    ++dirty_;
+  }
+}
+
+// Bulk file data is not cached: blocks already in the cache are served
+// from it, the rest go straight to the disk.
+void buffer_cache::read_blocks(blockid_t id, uint32_t count, char *buf) {
+  for (uint32_t i = 0; i < count; ++i, buf += block_size_) {
+    auto &s = shard_of(id + i);
+    std::unique_lock<std::mutex> l(s.m);
+    auto it = s.map.find(id + i);
+    if (it != s.map.end()) {
+      memcpy(buf, frame_data(s, it->second), block_size_);
+    } else {
+      d_->read_block(id + i, buf);
+    }
+  }
+}
+
+void buffer_cache::write_blocks(blockid_t id, uint32_t count,
+                                const char *buf) {
+  for (uint32_t i = 0; i < count; ++i, buf += block_size_) {
+    auto &s = shard_of(id + i);
+    std::unique_lock<std::mutex> l(s.m);
+    auto it = s.map.find(id + i);
+    if (it != s.map.end()) {
+      memcpy(frame_data(s, it->second), buf, block_size_);
+      if (!s.frames[it->second].dirty) {
+        s.frames[it->second].dirty = true;
+        ++dirty_;
+      }
+    } else {
+      d_->write_block(id + i, buf);
+    }
+  }
+}
+
+// Write every dirty frame back to the disk.
+void buffer_cache::flush() {
+  for (uint32_t i = 0; i < NCACHE_SHARDS; ++i) {
+    auto &s = shards_[i];
+    std::unique_lock<std::mutex> l(s.m);
+    for (uint32_t f = 0; f < s.frames.size(); ++f) {
+      if (s.frames[f].valid && s.frames[f].dirty) {
+        d_->write_block(s.frames[f].id, frame_data(s, f));
+        s.frames[f].dirty = false;
+        --dirty_;
+      }
+    }
+  }
+}
+
+// Hand back the memory of the disk pages holding the blocks of u, saved
+// to the image by now. Every write to a block holds its shard's lock, so
+// with those of a page held the disk can tell whether it is still clean.
+void buffer_cache::release(const disk_update &u) {
+  auto n = d_->release_unit();
+  auto done = UINT64_MAX;
+  for (auto id : u.ids) {
+    auto first = id / n * n;
+    if (first == done) {
+      continue;
+    }
+    done = first;
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < MIN(n, uint32_t(NCACHE_SHARDS)); ++i) {
+      mask |= 1u << ((first + i) % NCACHE_SHARDS);
+    }
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (uint32_t k = 0; k < NCACHE_SHARDS; ++k) {
+      if (mask & (1u << k)) {
+        locks.emplace_back(shards_[k].m);
+      }
+    }
+    d_->release(first);
+  }
+}
+
+// Find a clear bit in a bitmap block of nwords words at or after bit from,
+// scanning a word at a time. Return nwords * 64 if there is none.
+static uint32_t scan_bitmap(const uint64_t *words, uint32_t nwords,
+                            uint32_t from) {
+  auto w = from / 64;
+  auto mask = ~words[w] & (~0ULL << (from % 64));
+  while (mask == 0) {
+    if (++w == nwords) {
+      return nwords * 64;
+    }
+    mask = ~words[w];
+  }
+  return w * 64 + __builtin_ctzll(mask);
+}
+
+// Pin a bitmap block in the cache and return it as words.
+uint64_t *block_manager::pin_bitmap(uint32_t bb) {
+  return reinterpret_cast<uint64_t *>(cache_->pin(bb));
+}
+
+// Search the bitmap from block from onwards, skipping bitmap blocks that
+// the free counts say are full, and wrap around once. Only the bitmap block
+// being searched is locked. Return NO_BLOCK if every block is in use.
+blockid_t block_manager::alloc_from(uint32_t from) {
+  auto bpb = BPB(sb.block_size);
+  auto nbitmap = nbitmap_;
+  auto start = from / bpb;
+  for (uint32_t k = 0; k <= nbitmap; ++k) {
+    auto idx = (start + k) % nbitmap;
+    if (free_count_[idx] == 0) {
+      continue;
+    }
+    std::unique_lock<std::mutex> l(bitmap_locks_[idx]);
+    auto *words = pin_bitmap(idx + 2);
+    auto bit = scan_bitmap(words, sb.block_size / 8, k == 0 ? from % bpb : 0);
+    if (bit == bpb) {
+      cache_->unpin(idx + 2, false);
+      continue;
+    }
+    words[bit / 64] |= 1ULL << (bit % 64);
+    cache_->unpin(idx + 2, true);
+    --free_count_[idx];
+    set_birth(idx * bpb + bit, 1);
+    return idx * bpb + bit;
+  }
+  return NO_BLOCK;
+}
+
+// Allocate a free disk block, NO_BLOCK if the disk is full.
+blockid_t block_manager::alloc_block() {
+  auto id = alloc_from(next_);
+  if (id != NO_BLOCK) {
+    next_ = (id + 1) % sb.nblocks;
+  }
+  return id;
+}
+
+// Allocate a free block at or after goal, NO_BLOCK if the disk is full.
+blockid_t block_manager::alloc_near(uint32_t goal) {
+  return alloc_from(goal % sb.nblocks);
+}
+
+// Claim up to n free blocks starting at id, stopping at the first used
+// block or the end of its bitmap block. Return how many were claimed.
+uint32_t block_manager::alloc_run_at(uint32_t id, uint32_t n) {
+  auto bpb = BPB(sb.block_size);
+  if (id >= sb.nblocks || free_count_[id / bpb] == 0) {
+    return 0;
+  }
+  std::unique_lock<std::mutex> l(bitmap_locks_[id / bpb]);
+  auto bb = BBLOCK(id, sb.block_size);
+  auto *words = pin_bitmap(bb);
+  uint32_t got = 0;
+  for (auto bit = id % bpb; got < n && bit < bpb; ++bit, ++got) {
+    if (words[bit / 64] & (1ULL << (bit % 64))) {
+      break;
+    }
+    words[bit / 64] |= 1ULL << (bit % 64);
+  }
+  cache_->unpin(bb, got != 0);
+  free_count_[id / bpb] -= got;
+  set_birth(id, got);
+  return got;
+}
+
+// Allocate a run of up to n contiguous blocks, starting at the first free
+// block at or after goal. Return its first block, with its length in *got;
+// NO_BLOCK, with *got 0, if the disk is full.
+uint32_t block_manager::alloc_run_near(uint32_t goal, uint32_t n,
+                                       uint32_t *got) {
+  *got = 0;
+  auto id = alloc_near(goal);
+  if (id == NO_BLOCK) {
+    return NO_BLOCK;
+  }
+  *got = 1 + (n > 1 ? alloc_run_at(id + 1, n - 1) : 0);
+  return id;
+}
+
+// Allocate exactly n contiguous blocks: the first long enough free run at
+// or after goal, wrapping around once. Runs never cross a bitmap block.
+// Return its first block, NO_BLOCK if there is none.
+uint32_t block_manager::alloc_extent(uint32_t goal, uint32_t n) {
+  if (n == 0 || n > BPB(sb.block_size)) {
+    return NO_BLOCK;
+  }
+  uint64_t scanned = 0;
+  for (auto from = goal % sb.nblocks; scanned < sb.nblocks;) {
+    uint32_t got;
+    auto id = alloc_run_near(from, n, &got);
+    if (id == NO_BLOCK) {
+      return NO_BLOCK;
+    }
+    if (got == n) {
+      return id;
+    }
+    for (uint32_t i = 0; i < got; ++i) {
+      free_block(id + i);
+    }
+    scanned += (id + sb.nblocks - from) % sb.nblocks + got + 1;
+    from = (id + got + 1) % sb.nblocks;
+  }
+  return NO_BLOCK;
+}
+
+// Blocks currently free.
+uint64_t block_manager::free_blocks() const {
+  uint64_t n = 0;
+  for (uint32_t i = 0; i < nbitmap_; ++i) {
+    n += free_count_[i];
+  }
+  return n;
+}
+
+// Drop a reference to a block. It is freed once no file maps it, unless a
+// snapshot still holds it: then it is marked dead, and freed once the last
+// snapshot seeing it is deleted. Reference counts change under the lock of
+// the block's bitmap block.
+void block_manager::free_block(uint32_t id) {
+  auto bpb = BPB(sb.block_size);
+  std::unique_lock<std::mutex> l(bitmap_locks_[id / bpb]);
+  auto info = read_info(id);
+  if (info.refs != 0) {
+    --info.refs;
+    write_info(id, info);
+    return;
+  }
+  if (info.birth < newest_) {
+    info.death = gen_;
+    write_info(id, info);
+    return;
+  }
+  clear_bit(id);
+}
+
+// Free a block no file maps and no snapshot reads through a file, such as
+// a snapshot's copy of an inode block, whatever its generation.
+void block_manager::release_block(uint32_t id) {
+  std::unique_lock<std::mutex> l(bitmap_locks_[id / BPB(sb.block_size)]);
+  clear_bit(id);
+}
+
+// Clear the bitmap bit of block id. Caller holds its bitmap block's lock.
+void block_manager::clear_bit(uint32_t id) {
+  auto bpb = BPB(sb.block_size);
+  auto bb = BBLOCK(id, sb.block_size);
+  auto *words = pin_bitmap(bb);
+  auto bit = id % bpb;
+  bool used = words[bit / 64] & (1ULL << (bit % 64));
+  if (used) {
+    words[bit / 64] &= ~(1ULL << (bit % 64));
+    ++free_count_[id / bpb];
+  }
+  cache_->unpin(bb, used);
+}
+
+// Recount the clear bits of every bitmap block.
+void block_manager::load_free_counts() {
+  auto bpb = BPB(sb.block_size);
+  for (uint32_t i = 0; i < nbitmap_; ++i) {
+    auto *words = pin_bitmap(i + 2);
+    uint32_t used = 0;
+    for (uint32_t w = 0; w < sb.block_size / 8; ++w) {
+      used += __builtin_popcountll(words[w]);
+    }
+    cache_->unpin(i + 2, false);
+    free_count_[i] = bpb - used;
+  }
+}
+
+// The layout of disk should be like this:
+// |<-boot->|<-sb->|<-block bitmap->|<-inode bitmap->|<-group 0->|<-group 1->..
+// where every group is
+// |<-block_info table->|<-inode table->|<-data->|
+// Group g > 0 starts at block g * BPB; group 0 right after the inode bitmap.
+// An image that already holds a file system of the same geometry is
+// mounted as is; anything else is formatted.
+block_manager::block_manager(uint32_t block_size, uint64_t disk_size,
+                             uint32_t ninodes, const std::string &image)
+    : next_(0), gen_(0), newest_(0), sb(), mounted(false) {
+  // format the disk
+  sb.block_size = block_size;
+  sb.nblocks = disk_size / block_size;
+  sb.size = uint64_t(sb.nblocks) * block_size;
+  sb.ninodes = ninodes;
+  auto nbitmap = NBITMAP(sb.nblocks, block_size);
+  if (block_size < 512 || (block_size & (block_size - 1)) != 0 ||
+      disk_size / block_size > UINT32_MAX || sb.nblocks <= nbitmap + 2) {
+    printf("\tbm: error! bad geometry, block size %u, disk size %lu\n",
+           block_size, static_cast<unsigned long>(disk_size));
+    exit(1);
+  }
+  nbitmap_ = nbitmap;
+  bitmap_locks_.reset(new std::mutex[nbitmap]);
+  free_count_.reset(new std::atomic<uint32_t>[nbitmap]);
+  d = new disk(block_size, sb.nblocks, image);
+  cache_ = new buffer_cache(d, block_size, CACHE_BLOCKS);
+
+  if (d->image_existed()) {
+    superblock_t on_disk;
+    read_block(1, reinterpret_cast<char *>(&on_disk), sizeof(on_disk));
+    if (on_disk.magic != SB_MAGIC || on_disk.size != sb.size ||
+        on_disk.nblocks != sb.nblocks || on_disk.ninodes != sb.ninodes ||
+        on_disk.block_size != sb.block_size) {
+      printf("\tbm: error! image does not match the disk geometry\n");
+      exit(1);
+    }
+    sb = on_disk;
+    gen_ = sb.gen;
+    newest_ = sb.nsnapshots != 0 ? sb.snapshots[sb.nsnapshots - 1].id : 0;
+    load_free_counts();
+    mounted = true;
+    return;
+  }
+  sb.magic = SB_MAGIC;
+
+  // The tail of the last bitmap block maps past the end of the disk.
+  auto bpb = BPB(block_size);
+  if (sb.nblocks % bpb != 0) {
+    auto *words = pin_bitmap(nbitmap + 1);
+    for (auto bit = sb.nblocks % bpb; bit < bpb; ++bit) {
+      words[bit / 64] |= 1ULL << (bit % 64);
+    }
+    cache_->unpin(nbitmap + 1, true);
+  }
+  load_free_counts();
+
+  auto blockid_boot = alloc_block();
+  if (blockid_boot != 0) {
+    printf("\tbm: error! alloc boot block, id %d should be 0\n", blockid_boot);
+    exit(1);
+  }
+  auto blockid_super = alloc_block();
+  if (blockid_super != 1) {
+    printf("\tbm: error! alloc super block, id %d should be 1\n",
+           blockid_super);
+    exit(1);
+  }
+  for (uint32_t i = 0; i < nbitmap; ++i) {
+    alloc_block();
+  }
+  write_block(blockid_super, reinterpret_cast<const char *>(&sb),
+              sizeof(sb));
+}
+
+void block_manager::read_block(uint32_t id, char *buf) {
+  cache_->read(id, 0, sb.block_size, buf);
+}
+void block_manager::read_block(uint32_t id, char *buf, uint32_t n) {
+  cache_->read(id, 0, MIN(n, sb.block_size), buf);
+}
+
+void block_manager::write_block(uint32_t id, const char *buf) {
+  cache_->write(id, 0, sb.block_size, buf);
+}
+
+void block_manager::read_blocks(uint32_t id, uint32_t count, char *buf) {
+  cache_->read_blocks(id, count, buf);
+}
+
+void block_manager::write_blocks(uint32_t id, uint32_t count,
+                                 const char *buf) {
+  cache_->write_blocks(id, count, buf);
+}
+
+void block_manager::read_bytes(uint32_t id, uint32_t off, uint32_t n,
+                               char *buf) {
+  cache_->read(id, off, n, buf);
+}
+
+void block_manager::write_bytes(uint32_t id, uint32_t off, uint32_t n,
+                                const char *buf) {
+  cache_->write(id, off, n, buf);
+}
+
+// Write back the buffer cache to the disk. Bitmap blocks are edited while
+// pinned, so their locks are held to get a stable copy.
+void block_manager::sync() {
+  std::vector<std::unique_lock<std::mutex>> locks;
+  for (uint32_t i = 0; i < nbitmap_; ++i) {
+    locks.emplace_back(bitmap_locks_[i]);
+  }
+  cache_->flush();
+}
+
+// Write back the buffer cache and copy the disk blocks written since the
+// last checkpoint into u. The locks are held only for the copying; save()
+// does the file I/O.
+void block_manager::checkpoint(disk_update &u) {
+  std::vector<std::unique_lock<std::mutex>> locks;
+  for (uint32_t i = 0; i < nbitmap_; ++i) {
+    locks.emplace_back(bitmap_locks_[i]);
+  }
+  cache_->flush();
+  d->take_dirty(u);
+}
+
+void block_manager::save(const disk_update &u) {
+  d->save(u);
+  cache_->release(u);
+}
+
+void block_manager::write_block(uint32_t id, const char *buf, uint32_t n) {
+  if (n >= sb.block_size) {
+    cache_->write(id, 0, sb.block_size, buf);
+  } else {
+    std::vector<char> b(sb.block_size);
+    memcpy(b.data(), buf, n);
+    cache_->write(id, 0, sb.block_size, b.data());
+  }
+}
+
+void block_manager::occupy_block(uint32_t id) {
+  auto bpb = BPB(sb.block_size);
+  std::unique_lock<std::mutex> l(bitmap_locks_[id / bpb]);
+  auto bb = BBLOCK(id, sb.block_size);
+  auto *words = pin_bitmap(bb);
+  auto bit = id % bpb;
+  bool used = words[bit / 64] & (1ULL << (bit % 64));
+  if (!used) {
+    words[bit / 64] |= 1ULL << (bit % 64);
+    --free_count_[id / bpb];
+    set_birth(id, 1);
+  }
+  cache_->unpin(bb, !used);
+}
+
+// Where the block_info of block id lives: block *bid, at byte *off.
+void block_manager::info_block(uint32_t id, blockid_t *bid, uint32_t *off) {
+  auto pos = BINFO_OFFSET(id, sb);
+  *bid = GROUP_START(BGROUP(id, sb), sb) + pos / sb.block_size;
+  *off = pos % sb.block_size;
+}
+
+block_info_t block_manager::read_info(uint32_t id) {
+  blockid_t bid;
+  uint32_t off;
+  block_info_t info;
+  info_block(id, &bid, &off);
+  cache_->read(bid, off, sizeof(info), reinterpret_cast<char *>(&info));
+  return info;
+}
+
+void block_manager::write_info(uint32_t id, const block_info_t &info) {
+  blockid_t bid;
+  uint32_t off;
+  info_block(id, &bid, &off);
+  cache_->write(bid, off, sizeof(info), reinterpret_cast<const char *>(&info));
+}
+
+// Record the current generation as the birth of the newly allocated
+// blocks [id, id + n); a free block has no other references. Until the
+// first snapshot every block is of generation 0, as formatted.
+void block_manager::set_birth(uint32_t id, uint32_t n) {
+  uint32_t gen = gen_;
+  if (gen == 0) {
+    return;
+  }
+  for (auto b = id; b < id + n; ++b) {
+    write_info(b, {gen, 0, 0, 0});
+  }
+}
+
+// Whether another file or a snapshot may still read block id, so it must
+// not be written in place.
+bool block_manager::shared(uint32_t id) {
+  auto info = read_info(id);
+  return info.refs != 0 || info.birth < newest_;
+}
+
+// Add a reference to block id for a file cloned from one mapping it.
+void block_manager::share_block(uint32_t id) {
+  std::unique_lock<std::mutex> l(bitmap_locks_[id / BPB(sb.block_size)]);
+  auto info = read_info(id);
+  ++info.refs;
+  write_info(id, info);
+}
+
+// Start a new generation: every block in use now is frozen for the
+// snapshot being taken.
+void block_manager::new_generation() {
+  gen_ = ++sb.gen;
+  newest_ = sb.gen;
+  write_super();
+}
+
+// After a snapshot is deleted from sb, free every dead block that none of
+// the snapshots left sees, one bitmap block at a time. Return the number
+// of blocks freed.
+uint64_t block_manager::unpin_blocks() {
+  auto bpb = BPB(sb.block_size);
+  auto n = sb.nsnapshots;
+  newest_ = n != 0 ? sb.snapshots[n - 1].id : 0;
+  uint64_t freed = 0;
+  for (uint32_t i = 0; i < nbitmap_; ++i) {
+    std::unique_lock<std::mutex> l(bitmap_locks_[i]);
+    auto *words = pin_bitmap(i + 2);
+    auto end = MIN(sb.nblocks - i * bpb, bpb);
+    for (uint32_t bit = 0; bit < end; ++bit) {
+      if (!(words[bit / 64] & (1ULL << (bit % 64)))) {
+        continue;
+      }
+      auto id = i * bpb + bit;
+      auto info = read_info(id);
+      if (info.death == 0 || info.refs != 0) {
+        continue;
+      }
+      bool seen = false;
+      for (uint32_t k = 0; k < n && !seen; ++k) {
+        auto snap = sb.snapshots[k].id;
+        seen = info.birth < snap && snap <= info.death;
+      }
+      if (!seen) {
+        words[bit / 64] &= ~(1ULL << (bit % 64));
+        ++free_count_[i];
+        write_info(id, {0, 0, 0, 0});
+        ++freed;
+      }
+    }
+    cache_->unpin(i + 2, true);
+  }
+  write_super();
+  return freed;
+}
+
+void block_manager::write_super() {
+  write_block(1, reinterpret_cast<const char *>(&sb), sizeof(sb));
+}
+
+// inode layer -----------------------------------------
+
+inode_manager::inode_manager(uint32_t block_size, uint64_t disk_size,
+                             uint32_t ninodes, const std::string &image)
+    : next_inum_(1),
+      ilocks_(new std::shared_mutex[NINODE_LOCKS]),
+      atime_mode_(ATIME_RELATIME) {
+  bm = new block_manager(block_size, disk_size, ninodes, image);
+  auto nimap = NIBITMAP(bm->sb);
+  imap_.resize(nimap * block_size / sizeof(uint64_t));
+  if (bm->mounted) {
+    bm->read_blocks(IMAPBLOCK(0, bm->sb), nimap,
+                    reinterpret_cast<char *>(imap_.data()));
+    for (uint32_t k = 0; k < bm->sb.nsnapshots; ++k) {
+      std::vector<blockid_t> copies(nmeta());
+      std::vector<char> b(block_size);
+      for (uint32_t i = 0; i < copies.size(); i += block_size / 4) {
+        bm->read_block(bm->sb.snapshots[k].copies + i * 4 / block_size,
+                       b.data());
+        auto n = MIN(block_size / 4, copies.size() - i);
+        memcpy(&copies[i], b.data(), n * sizeof(blockid_t));
+      }
+      snap_copies_.push_back(std::move(copies));
+    }
+    return;
+  }
+
+  // Reserve the inode bitmap right behind the block bitmap, then the block
+  // table and inode table at the start of every group.
+  for (uint32_t i = 0; i < nimap; ++i) {
+    auto id = bm->alloc_block();
+    if (id != IMAPBLOCK(0, bm->sb) + i) {
+      printf("\tim: error! alloc inode bitmap block %d\n", id);
+      exit(1);
+    }
+  }
+  auto itable = ITABLE(bm->sb);
+  for (uint32_t g = 0; g < NGROUPS(bm->sb); ++g) {
+    auto start = GROUP_START(g, bm->sb);
+    auto n = NBINFO(g, bm->sb) + itable;
+    if (bm->alloc_run_at(start, n) != n) {
+      printf("\tim: error! inode table of group %u does not fit\n", g);
+      exit(1);
+    }
+  }
+
+  // Inode 0 and the bits past the last inode are never handed out.
+  for (uint64_t i = ninodes + 1; i < imap_.size() * 64; ++i) {
+    imap_[i / 64] |= 1ULL << (i % 64);
+  }
+  imap_[0] |= 1;
+  for (uint32_t i = 0; i < nimap; ++i) {
+    bm->write_block(IMAPBLOCK(0, bm->sb) + i,
+                    reinterpret_cast<char *>(&imap_[i * block_size / 8]));
+  }
+
+  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
+  if (root_dir != 1) {
+    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
+    exit(0);
+  }
+  // Checkpoints come later, but the image has to be mountable right away.
+  disk_update u;
+  checkpoint(u);
+  save(u);
+}
+
+/* Set or clear the inode bitmap bit of inode inum. Caller holds m_. */
+void inode_manager::mark_inode(uint32_t inum, bool used) {
+  if (used) {
+    imap_[inum / 64] |= 1ULL << (inum % 64);
+  } else {
+    imap_[inum / 64] &= ~(1ULL << (inum % 64));
+  }
+  imap_dirty_.insert(IMAPBLOCK(inum, bm->sb));
+}
+
+/* Create a new file.
+ * The inode bitmap is scanned a word at a time from a rotating cursor.
+ * Return its inum, 0 if the inode table is full or there is no room to
+ * keep the blocks it changes for a snapshot. */
+uint32_t inode_manager::alloc_inode(uint32_t type) {
+  std::unique_lock<std::mutex> l(m_);
+  auto nwords = static_cast<uint32_t>(imap_.size());
+  auto start = next_inum_ / 64;
+  for (uint32_t k = 0; k <= nwords; ++k) {
+    auto w = (start + k) % nwords;
+    auto mask = ~imap_[w];
+    if (k == 0) {
+      mask &= ~0ULL << (next_inum_ % 64);
+    }
+    if (mask == 0) {
+      continue;
+    }
+    uint32_t inum = w * 64 + __builtin_ctzll(mask);
+    if (!preserve(IMAPBLOCK(inum, bm->sb)) || !preserve(IBLOCK(inum, bm->sb))) {
+      return 0;
+    }
+    mark_inode(inum, true);
+    auto &ino = cached_inode(inum);
+    bzero(&ino, sizeof(ino));
+    ino.type = type;
+    ino.flags = INODE_INLINE;
+    ino.ctime = time(nullptr);
+    ino.mtime = time(nullptr);
+    ino.atime = time(nullptr);
+    idirty_.insert(IBLOCK(inum, bm->sb));
+    next_inum_ = inum % bm->sb.ninodes + 1;
+    return inum;
+  }
+  return 0;
+}
+
+/* Free inode inum. Caller holds its lock and prepared the write. */
+void inode_manager::free_inode(uint32_t inum) {
+  std::unique_lock<std::mutex> l(m_);
+  mark_inode(inum, false);
+  auto &ino = cached_inode(inum);
+  bzero(&ino, sizeof(ino));
+  idirty_.insert(IBLOCK(inum, bm->sb));
+  std::unique_lock<std::mutex> el(emap_m_);
+  emaps_.erase(inum);
+}
+
+/* Return the cached copy of inode inum, loading its whole inode block on
+ * a miss. Caller holds m_ and has checked inum. */
+struct inode &inode_manager::cached_inode(uint32_t inum) {
+  auto bs = bm->sb.block_size;
+  auto bid = IBLOCK(inum, bm->sb);
+  auto it = icache_.find(bid);
+  if (it == icache_.end()) {
+    std::vector<char> buf(bs);
+    bm->read_block(bid, buf.data());
+    auto *first = reinterpret_cast<inode *>(buf.data());
+    it = icache_.emplace(bid, std::vector<inode_t>(first, first + IPB(bs)))
+             .first;
+  }
+  return it->second[ISLOT(inum, bm->sb)];
+}
+
+/* Where the data of inode inum should go: right after the inode table of
+ * its group. */
+blockid_t inode_manager::data_goal(uint32_t inum) {
+  return ITABLE_START(IGROUP(inum, bm->sb), bm->sb) + ITABLE(bm->sb);
+}
+
+/* Return an inode structure by inum, NULL otherwise.
+ * Caller should release the memory. */
+struct inode *inode_manager::get_inode(uint32_t inum) {
+  if (inum == 0 || inum > bm->sb.ninodes) {
+    return nullptr;
+  }
+  std::unique_lock<std::mutex> l(m_);
+  if (!(imap_[inum / 64] & (1ULL << (inum % 64)))) {
+    return nullptr;
+  }
+  auto *i = static_cast<inode *>(malloc(sizeof(inode)));
+  *i = cached_inode(inum);
+  return i;
+}
+
+/* Record a read of inode inum according to atime_mode_. The update stays
+ * in the inode cache and reaches the disk with the next flush, so reads
+ * never write the inode block themselves. */
+void inode_manager::touch_atime(uint32_t inum) {
+  if (atime_mode_ == ATIME_NOATIME) {
+    return;
+  }
+  std::unique_lock<std::mutex> l(m_);
+  auto &ino = cached_inode(inum);
+  unsigned int now = time(nullptr);
+  if (atime_mode_ == ATIME_RELATIME && ino.atime > ino.mtime &&
+      ino.atime > ino.ctime && now - ino.atime < 24 * 60 * 60) {
+    return;
+  }
+  // A snapshot may need the old inode block kept first; with no room for
+  // that the read just leaves the access time.
+  if (ino.atime != now && preserve(IBLOCK(inum, bm->sb))) {
+    ino.atime = now;
+    idirty_.insert(IBLOCK(inum, bm->sb));
+  }
+}
+
+/* Store an inode structure into the cache; it reaches the disk at the
+ * next flush. Caller prepared the write. */
+void inode_manager::put_inode(uint32_t inum, const struct inode *ino) {
+  std::unique_lock<std::mutex> l(m_);
+  cached_inode(inum) = *ino;
+  idirty_.insert(IBLOCK(inum, bm->sb));
+}
+
+/* Write back every dirty inode bitmap and inode block, then the buffer
+ * cache. */
+void inode_manager::flush() {
+  std::unique_lock<std::mutex> l(m_);
+  write_meta();
+  bm->sync();
+}
+
+/* Write every dirty inode bitmap and inode block to the buffer cache.
+ * Every inode of a cached block is in the cache, so the block is rebuilt
+ * without reading it first. The version the latest snapshot saw was copied
+ * aside when the block was first dirtied. Caller holds m_. */
+void inode_manager::write_meta() {
+  auto bs = bm->sb.block_size;
+  for (auto bid : imap_dirty_) {
+    auto w = (bid - IMAPBLOCK(0, bm->sb)) * bs / sizeof(uint64_t);
+    bm->write_block(bid, reinterpret_cast<char *>(&imap_[w]));
+  }
+  imap_dirty_.clear();
+
+  std::vector<char> buf(bs);
+  for (auto bid : idirty_) {
+    const auto &inodes = icache_[bid];
+    std::copy(inodes.begin(), inodes.end(),
+              reinterpret_cast<inode *>(buf.data()));
+    bm->write_block(bid, buf.data());
+  }
+  idirty_.clear();
+}
+
+/* Copy the file system as it stands into u, to be written out by save().
+ * Every file operation in progress is waited out first, as snapshot()
+ * does, so none is caught half done. lsn, the log position the copy
+ * covers, goes into the superblock along with it. Only the blocks written
+ * since the last checkpoint are copied. */
+void inode_manager::checkpoint(disk_update &u, uint64_t lsn) {
+  std::vector<std::unique_lock<std::shared_mutex>> locks;
+  for (uint32_t i = 0; i < NINODE_LOCKS; ++i) {
+    locks.emplace_back(ilocks_[i]);
+  }
+  {
+    std::unique_lock<std::mutex> l(m_);
+    bm->sb.lsn = lsn;
+    bm->write_super();
+  }
+  flush();
+  bm->checkpoint(u);
+}
+
+/* Write a checkpoint taken by checkpoint() to the image. File operations
+ * go on meanwhile. */
+void inode_manager::save(const disk_update &u) { bm->save(u); }
+
+/* Index of an inode bitmap or inode table block in a snapshot's table of
+ * copies. */
+uint32_t inode_manager::meta_slot(blockid_t bid) {
+  const auto &sb = bm->sb;
+  if (bid < GROUP_START(0, sb)) {
+    return bid - IMAPBLOCK(0, sb);
+  }
+  auto g = MIN(bid / BPB(sb.block_size), NGROUPS(sb) - 1);
+  return NIBITMAP(sb) + g * ITABLE(sb) + bid - ITABLE_START(g, sb);
+}
+
+uint32_t inode_manager::nmeta() {
+  return NIBITMAP(bm->sb) + NGROUPS(bm->sb) * ITABLE(bm->sb);
+}
+
+/* Before inode bitmap or inode block bid is first dirtied after a
+ * snapshot, keep a copy of its disk contents for the latest snapshot,
+ * unless it has one already. Return false if there is no room for the
+ * copy: the change must not be made. Caller holds m_. */
+bool inode_manager::preserve(blockid_t bid) {
+  if (snap_copies_.empty()) {
+    return true;
+  }
+  auto slot = meta_slot(bid);
+  auto &copies = snap_copies_.back();
+  if (copies[slot] != 0) {
+    return true;
+  }
+  auto bs = bm->sb.block_size;
+  auto copy = bm->alloc_block();
+  if (copy == NO_BLOCK) {
+    return false;
+  }
+  std::vector<char> b(bs);
+  bm->read_block(bid, b.data());
+  bm->write_block(copy, b.data());
+  copies[slot] = copy;
+  auto table = bm->sb.snapshots[bm->sb.nsnapshots - 1].copies;
+  bm->write_bytes(table + slot * sizeof(blockid_t) / bs,
+                  slot * sizeof(blockid_t) % bs, sizeof(blockid_t),
+                  reinterpret_cast<const char *>(&copy));
+  return true;
+}
+
+/* Make sure the inode block of inum, and its inode bitmap block if imap,
+ * can be rewritten: the latest snapshot has its copies. An operation calls
+ * this before it changes anything, holding the inode's lock so no snapshot
+ * comes in between. Return false if the disk has no room for the copies. */
+bool inode_manager::prepare_write(uint32_t inum, bool imap) {
+  std::unique_lock<std::mutex> l(m_);
+  return preserve(IBLOCK(inum, bm->sb)) &&
+         (!imap || preserve(IMAPBLOCK(inum, bm->sb)));
+}
+
+/* Read inode bitmap or inode block bid as snapshot k saw it: its own copy,
+ * else the copy of the next newer snapshot, as the block did not change in
+ * between, else the block itself. Caller holds m_. */
+void inode_manager::snapshot_block(uint32_t k, blockid_t bid, char *buf) {
+  auto slot = meta_slot(bid);
+  for (auto j = k; j < snap_copies_.size(); ++j) {
+    if (snap_copies_[j][slot] != 0) {
+      bm->read_block(snap_copies_[j][slot], buf);
+      return;
+    }
+  }
+  bm->read_block(bid, buf);
+}
 
-void disk::read_block(blockid_t id, char *buf) {
-  memcpy(buf, blocks[id], BLOCK_SIZE);
+/* Freeze the file system as it is now and return the new snapshot's id,
+ * 0 if NSNAPSHOTS are kept already. Taking one writes back the inodes and
+ * starts a new block generation; nothing is copied until the live file
+ * system overwrites a block the snapshot still sees. */
+uint32_t inode_manager::snapshot() {
+  // Wait out every file operation in progress.
+  std::vector<std::unique_lock<std::shared_mutex>> locks;
+  for (uint32_t i = 0; i < NINODE_LOCKS; ++i) {
+    locks.emplace_back(ilocks_[i]);
+  }
+  // Dirty blocks are written under the same hold of m_ as the new
+  // generation starts, so none dirtied in between misses its copy.
+  std::unique_lock<std::mutex> l(m_);
+  if (bm->sb.nsnapshots == NSNAPSHOTS) {
+    return 0;
+  }
+  write_meta();
+  auto bs = bm->sb.block_size;
+  auto n = (nmeta() * sizeof(blockid_t) + bs - 1) / bs;
+  auto table = bm->alloc_extent(0, n);
+  if (table == NO_BLOCK) {
+    return 0;
+  }
+  std::vector<char> zeros(bs);
+  for (uint32_t i = 0; i < n; ++i) {
+    bm->write_block(table + i, zeros.data());
+  }
+  snap_copies_.emplace_back(nmeta());
+
+  auto &snap = bm->sb.snapshots[bm->sb.nsnapshots];
+  snap.id = bm->sb.gen + 1;
+  snap.time = time(nullptr);
+  snap.copies = table;
+  ++bm->sb.nsnapshots;
+  bm->new_generation();
+  return snap.id;
 }
 
-void disk::write_block(blockid_t id, const char *buf) {
-  memcpy(blocks[id], buf, BLOCK_SIZE);
+/* Delete snapshot id. Its copies of inode blocks go to the next older
+ * snapshot, which saw the same blocks unless it has copies of its own, or
+ * are freed, and so are the blocks files dropped that no snapshot left
+ * sees. Return false if there is no such snapshot. */
+bool inode_manager::delete_snapshot(uint32_t id) {
+  std::vector<std::unique_lock<std::shared_mutex>> locks;
+  for (uint32_t i = 0; i < NINODE_LOCKS; ++i) {
+    locks.emplace_back(ilocks_[i]);
+  }
+  std::unique_lock<std::mutex> l(m_);
+  auto &sb = bm->sb;
+  uint32_t k = 0;
+  while (k < sb.nsnapshots && sb.snapshots[k].id != id) {
+    ++k;
+  }
+  if (k == sb.nsnapshots) {
+    return false;
+  }
+
+  auto bs = sb.block_size;
+  auto &copies = snap_copies_[k];
+  for (uint32_t slot = 0; slot < copies.size(); ++slot) {
+    if (copies[slot] == 0) {
+      continue;
+    }
+    if (k == 0 || snap_copies_[k - 1][slot] != 0) {
+      bm->release_block(copies[slot]);
+      continue;
+    }
+    snap_copies_[k - 1][slot] = copies[slot];
+    bm->write_bytes(sb.snapshots[k - 1].copies + slot * sizeof(blockid_t) / bs,
+                    slot * sizeof(blockid_t) % bs, sizeof(blockid_t),
+                    reinterpret_cast<const char *>(&copies[slot]));
+  }
+  auto n = (nmeta() * sizeof(blockid_t) + bs - 1) / bs;
+  for (uint32_t i = 0; i < n; ++i) {
+    bm->release_block(sb.snapshots[k].copies + i);
+  }
+  snap_copies_.erase(snap_copies_.begin() + k);
+  std::copy(sb.snapshots + k + 1, sb.snapshots + sb.nsnapshots,
+            sb.snapshots + k);
+  --sb.nsnapshots;
+  bm->unpin_blocks();
+  return true;
 }
 
-// block layer -----------------------------------------
+/* The current generation: the id of the newest snapshot taken, whether
+ * it is kept or not. */
+uint32_t inode_manager::generation() {
+  std::unique_lock<std::mutex> l(m_);
+  return bm->sb.gen;
+}
 
-// Allocate a free disk block.
-blockid_t block_manager::alloc_block() {
+void inode_manager::list_snapshots(std::vector<snapshot_t> &snaps) {
   std::unique_lock<std::mutex> l(m_);
-  auto buf = static_cast<char *>(malloc(BLOCK_SIZE));
-  auto id = 0;
-  auto bb = 0;
-  for (; id < BLOCK_NUM; ++id) {
-    if (bb != BBLOCK(id)) {
-      bb = BBLOCK(id);
-      read_block(bb, buf);
-    }
-    if (!(buf[id % BPB / 8] & (1 << (id & 0x7)))) {
-      buf[id % BPB / 8] |= (1 << (id & 0x7));
-      write_block(bb, buf);
-      free(buf);
-      return id;
+  snaps.assign(bm->sb.snapshots, bm->sb.snapshots + bm->sb.nsnapshots);
+}
+
+/* Read the contents of file inum as snapshot id saw it. Return false if
+ * there is no such snapshot or the file did not exist then. Blocks a
+ * snapshot sees never change, so only the inode lookup takes m_. */
+bool inode_manager::read_snapshot(uint32_t id, uint32_t inum,
+                                  std::string &buf) {
+  buf.clear();
+  const auto &sb = bm->sb;
+  if (inum == 0 || inum > sb.ninodes) {
+    return false;
+  }
+  inode_t ino;
+  {
+    std::unique_lock<std::mutex> l(m_);
+    uint32_t k = 0;
+    while (k < sb.nsnapshots && sb.snapshots[k].id != id) {
+      ++k;
+    }
+    if (k == sb.nsnapshots) {
+      return false;
     }
+    std::vector<char> b(sb.block_size);
+    snapshot_block(k, IMAPBLOCK(inum, sb), b.data());
+    auto bit = inum % BPB(sb.block_size);
+    if (!(reinterpret_cast<uint64_t *>(b.data())[bit / 64] &
+          (1ULL << (bit % 64)))) {
+      return false;
+    }
+    snapshot_block(k, IBLOCK(inum, sb), b.data());
+    ino = reinterpret_cast<inode *>(b.data())[ISLOT(inum, sb)];
   }
 
-  free(buf);
-  return 0;
+  if (ino.flags & INODE_INLINE) {
+    buf.assign(INLINE_DATA(&ino), MIN(ino.size, NINLINE));
+    return true;
+  }
+  extent_map m;
+  m.exts.assign(ino.extents, ino.extents + MIN(ino.nextents, NEXTENT));
+  if (ino.index != 0) {
+    load_tree(ino.index, m);
+  }
+  buf.resize(ino.size);
+  if (ino.size != 0) {
+    read_extents(m.exts, 0, ino.size, &buf[0]);
+  }
+  return true;
 }
 
-blockid_t block_manager::alloc_block_back() {
-  std::unique_lock<std::mutex> l(m_);
-  auto buf = static_cast<char *>(malloc(BLOCK_SIZE));
-  auto id = BLOCK_NUM - 1;
-  auto bb = 0;
-  for (; id > 0; --id) {
-    if (bb != BBLOCK(id)) {
-      bb = BBLOCK(id);
-      read_block(bb, buf);
-    }
-    if (!(buf[id % BPB / 8] & (1 << (id & 0x7)))) {
-      buf[id % BPB / 8] |= (1 << (id & 0x7));
-      write_block(bb, buf);
-      free(buf);
-      return id;
+/* Append the extents of the tree block id and everything below it to m,
+ * in lblock order, along with the ids of the tree blocks. */
+void inode_manager::load_tree(blockid_t id, extent_map &m) {
+  auto bs = bm->sb.block_size;
+  std::vector<char> b(bs);
+  auto *eb = reinterpret_cast<extent_block_t *>(b.data());
+  m.index.push_back(id);
+  bm->read_block(id, b.data());
+  if (eb->level == 0) {
+    m.exts.insert(m.exts.end(), eb->extents,
+                  eb->extents + MIN(eb->n, NEXTENT_BLOCK(bs)));
+    return;
+  }
+  auto n = MIN(eb->n, NINDEX_BLOCK(bs));
+  std::vector<extent_index_t> children(EBLOCK_INDEX(eb), EBLOCK_INDEX(eb) + n);
+  for (const auto &c : children) {
+    load_tree(c.child, m);
+  }
+}
+
+/* Return the extent map of inode inum, walking its extent tree only if
+ * the map is not cached. Caller holds the inode lock. */
+std::shared_ptr<const extent_map> inode_manager::extent_map_of(
+    uint32_t inum, const inode *ino) {
+  if (ino->flags & INODE_INLINE) {
+    return std::make_shared<extent_map>();
+  }
+  {
+    std::unique_lock<std::mutex> l(emap_m_);
+    auto it = emaps_.find(inum);
+    if (it != emaps_.end()) {
+      return it->second;
     }
   }
+  auto m = std::make_shared<extent_map>();
+  m->exts.assign(ino->extents, ino->extents + MIN(ino->nextents, NEXTENT));
+  if (ino->index != 0) {
+    load_tree(ino->index, *m);
+  }
 
-  free(buf);
-  return 0;
+  std::unique_lock<std::mutex> l(emap_m_);
+  if (emaps_.size() >= EMAP_CACHE) {
+    emaps_.erase(emaps_.begin());
+  }
+  emaps_[inum] = m;
+  return m;
 }
 
-void block_manager::free_block(uint32_t id) {
-  std::unique_lock<std::mutex> l(m_);
-  auto buf = static_cast<char *>(malloc(BLOCK_SIZE));
-  auto bb = BBLOCK(id);
-  read_block(bb, buf);
-  buf[id % BPB / 8] &= ~(1 << (id & 0x7));
-  write_block(bb, buf);
-  free(buf);
+/* Copy out the extents of an inode for the caller to change.
+ * The ids of the extent tree blocks are returned in chain. */
+void inode_manager::load_extents(uint32_t inum, const inode *ino,
+                                 std::vector<extent_t> &exts,
+                                 std::vector<blockid_t> &chain) {
+  auto m = extent_map_of(inum, ino);
+  exts = m->exts;
+  chain = m->index;
 }
 
-// The layout of disk should be like this:
-// |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
-block_manager::block_manager() : sb() {
-  d = new disk();
-  auto blockid_boot = alloc_block();
-  if (blockid_boot != 0) {
-    printf("\tbm: error! alloc boot block, id %d should be 0\n", blockid_boot);
-    exit(1);
+/* Write exts back into the inode and its extent tree, reusing, growing or
+ * shrinking the tree blocks in chain as needed, and cache the new map.
+ * The tree is rebuilt level by level with full nodes, so it is only as
+ * deep as the extent count needs. The inode itself is not written. Return
+ * false, with the inode, chain and tree left as they were, if the disk has
+ * no room for the tree. */
+bool inode_manager::store_extents(uint32_t inum, inode *ino,
+                                  const std::vector<extent_t> &exts,
+                                  std::vector<blockid_t> &chain,
+                                  blockid_t goal) {
+  auto bs = bm->sb.block_size;
+  uint32_t n = exts.size();
+
+  // Nodes per level, leaves first, up to a single root.
+  auto rest = n > NEXTENT ? n - NEXTENT : 0;
+  std::vector<uint32_t> nodes;
+  if (rest != 0) {
+    nodes.push_back((rest + NEXTENT_BLOCK(bs) - 1) / NEXTENT_BLOCK(bs));
+    while (nodes.back() > 1) {
+      nodes.push_back((nodes.back() + NINDEX_BLOCK(bs) - 1) /
+                      NINDEX_BLOCK(bs));
+    }
   }
-  auto blockid_super = alloc_block();
-  if (blockid_super != 1) {
-    printf("\tbm: error! alloc super block, id %d should be 1\n",
-           blockid_super);
-    exit(1);
+  uint32_t need = 0;
+  for (auto k : nodes) {
+    need += k;
   }
-  for (int i = 0; i < BLOCK_NUM / BPB; ++i) {
-    alloc_block();
+  // Get every block of the new tree before giving up any of the old one.
+  // A snapshot may still read the old tree: rebuild it elsewhere.
+  std::vector<blockid_t> tree;
+  for (uint32_t i = 0; i < need; ++i) {
+    auto id = i < chain.size() && !bm->shared(chain[i]) ? chain[i]
+                                                        : bm->alloc_near(goal);
+    if (id == NO_BLOCK) {
+      for (uint32_t j = 0; j < i; ++j) {
+        if (j >= chain.size() || tree[j] != chain[j]) {
+          bm->free_block(tree[j]);
+        }
+      }
+      return false;
+    }
+    tree.push_back(id);
   }
-  // format the disk
-  sb.size = BLOCK_SIZE * BLOCK_NUM;
-  sb.nblocks = BLOCK_NUM;
-  sb.ninodes = INODE_NUM;
+  for (uint32_t i = 0; i < chain.size(); ++i) {
+    if (i >= need || tree[i] != chain[i]) {
+      bm->free_block(chain[i]);
+    }
+  }
+  chain.swap(tree);
+  ino->nextents = n;
+  bzero(ino->extents, sizeof(ino->extents));
+  std::copy(exts.begin(), exts.begin() + MIN(n, NEXTENT), ino->extents);
+
+  std::vector<char> b(bs);
+  auto *eb = reinterpret_cast<extent_block_t *>(b.data());
+  std::vector<extent_index_t> below;  // Nodes of the level just written
+  std::vector<extent_index_t> level;
+  uint32_t used = 0;
+  for (uint32_t k = 0; k < nodes.size(); ++k) {
+    level.clear();
+    for (uint32_t i = 0; i < nodes[k]; ++i) {
+      bzero(b.data(), bs);
+      eb->level = k;
+      if (k == 0) {
+        eb->n = MIN(NEXTENT_BLOCK(bs), rest - i * NEXTENT_BLOCK(bs));
+        auto first = exts.begin() + NEXTENT + i * NEXTENT_BLOCK(bs);
+        std::copy(first, first + eb->n, eb->extents);
+        level.push_back({first->lblock, chain[used]});
+      } else {
+        eb->n = MIN(NINDEX_BLOCK(bs), below.size() - i * NINDEX_BLOCK(bs));
+        auto first = below.begin() + i * NINDEX_BLOCK(bs);
+        std::copy(first, first + eb->n, EBLOCK_INDEX(eb));
+        level.push_back({first->lblock, chain[used]});
+      }
+      bm->write_block(chain[used++], b.data());
+    }
+    below.swap(level);
+  }
+  ino->index = need != 0 ? chain[need - 1] : 0;
+
+  auto m = std::make_shared<extent_map>();
+  m->exts = exts;
+  m->index = chain;
+  std::unique_lock<std::mutex> l(emap_m_);
+  if (emaps_.size() >= EMAP_CACHE && emaps_.count(inum) == 0) {
+    emaps_.erase(emaps_.begin());
+  }
+  emaps_[inum] = std::move(m);
+  return true;
 }
 
-void block_manager::read_block(uint32_t id, char *buf) {
-  d->read_block(id, buf);
+static bool lblock_before(uint32_t lblock, const extent_t &e) {
+  return lblock < e.lblock;
 }
-void block_manager::read_block(uint32_t id, char *buf, uint32_t n) {
-  if (n >= BLOCK_SIZE) {
-    d->read_block(id, buf);
-  } else {
-    char b[BLOCK_SIZE] = {0};
-    d->read_block(id, b);
-    memcpy(buf, b, n);
+
+/* Return the extent mapping file block lblock, NULL inside a hole. */
+static const extent_t *find_extent(const std::vector<extent_t> &exts,
+                                   uint32_t lblock) {
+  auto it = std::upper_bound(exts.begin(), exts.end(), lblock, lblock_before);
+  if (it == exts.begin() || (it - 1)->lblock + (it - 1)->len <= lblock) {
+    return nullptr;
   }
+  return &*(it - 1);
 }
 
-void block_manager::write_block(uint32_t id, const char *buf) {
-  d->write_block(id, buf);
+/* Count the contiguous disk runs of exts. Extents split only by a hole
+ * but adjacent on disk share a run. */
+static uint32_t count_runs(const std::vector<extent_t> &exts) {
+  uint32_t runs = 0;
+  for (uint32_t i = 0; i < exts.size(); ++i) {
+    if (i == 0 || exts[i].start != exts[i - 1].start + exts[i - 1].len) {
+      ++runs;
+    }
+  }
+  return runs;
 }
 
-void block_manager::write_block(uint32_t id, const char *buf, uint32_t n) {
-  if (n >= BLOCK_SIZE) {
-    d->write_block(id, buf);
-  } else {
-    char b[BLOCK_SIZE] = {0};
-    memcpy(b, buf, n);
-    d->write_block(id, b);
+static bool is_zero(const char *p, uint32_t n) {
+  return n == 0 || (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+/* Allocate blocks for the holes in file blocks [first, last). Each new run
+ * continues the disk run of the extent before it where possible, and
+ * adjacent runs are merged. The new blocks hold stale bytes. On failure
+ * nothing new stays mapped and false is returned; otherwise *added is the
+ * number of blocks mapped. */
+bool inode_manager::map_range(std::vector<extent_t> &exts, uint32_t first,
+                              uint32_t last, blockid_t goal,
+                              uint32_t *added) {
+  std::vector<extent_t> fresh;
+  auto it = std::upper_bound(exts.begin(), exts.end(), first, lblock_before);
+  auto lblock = first;
+  if (it != exts.begin()) {
+    auto &prev = *(it - 1);
+    goal = prev.start + prev.len;
+    lblock = MAX(lblock, prev.lblock + prev.len);
+  }
+  *added = 0;
+  while (lblock < last) {
+    auto stop = it == exts.end() ? last : MIN(last, it->lblock);
+    while (lblock < stop) {
+      uint32_t got = 0;
+      auto start = bm->alloc_run_near(goal, stop - lblock, &got);
+      if (got == 0) {
+        free_extents(fresh);
+        return false;
+      }
+      fresh.push_back({lblock, start, got});
+      lblock += got;
+      goal = start + got;
+      *added += got;
+    }
+    if (it == exts.end()) {
+      break;
+    }
+    lblock = MAX(lblock, it->lblock + it->len);
+    goal = it->start + it->len;
+    ++it;
   }
+  if (fresh.empty()) {
+    return true;
+  }
+
+  exts.insert(exts.end(), fresh.begin(), fresh.end());
+  std::sort(exts.begin(), exts.end(),
+            [](const extent_t &a, const extent_t &b) {
+              return a.lblock < b.lblock;
+            });
+  std::vector<extent_t> merged;
+  for (const auto &e : exts) {
+    if (!merged.empty()) {
+      auto &m = merged.back();
+      if (m.lblock + m.len == e.lblock && m.start + m.len == e.start) {
+        m.len += e.len;
+        continue;
+      }
+    }
+    merged.push_back(e);
+  }
+  exts.swap(merged);
+  return true;
 }
 
-void block_manager::occupy_block(uint32_t id) {
-  std::unique_lock<std::mutex> l(m_);
-  auto buf = static_cast<char *>(malloc(BLOCK_SIZE));
-  auto bb = BBLOCK(id);
-  read_block(bb, buf);
-  buf[id % BPB / 8] |= (1 << (id & 0x7));
-  write_block(bb, buf);
-  free(buf);
+/* Unmap file blocks [first, last), leaving a hole and splitting extents
+ * that straddle its ends. The blocks are added to dropped rather than
+ * freed: the caller frees them with free_extents once the new map is
+ * stored, and until then nothing else can take them. */
+void inode_manager::unmap_range(std::vector<extent_t> &exts, uint32_t first,
+                                uint32_t last,
+                                std::vector<extent_t> *dropped) {
+  std::vector<extent_t> kept;
+  for (const auto &e : exts) {
+    auto lo = MAX(e.lblock, first);
+    auto hi = MIN(e.lblock + e.len, last);
+    if (lo >= hi) {
+      kept.push_back(e);
+      continue;
+    }
+    dropped->push_back({lo, e.start + lo - e.lblock, hi - lo});
+    if (e.lblock < lo) {
+      kept.push_back({e.lblock, e.start, lo - e.lblock});
+    }
+    if (hi < e.lblock + e.len) {
+      kept.push_back({hi, e.start + hi - e.lblock, e.lblock + e.len - hi});
+    }
+  }
+  exts.swap(kept);
 }
 
-// inode layer -----------------------------------------
+/* Free every block mapped by exts. */
+void inode_manager::free_extents(const std::vector<extent_t> &exts) {
+  for (const auto &e : exts) {
+    for (uint32_t i = 0; i < e.len; ++i) {
+      bm->free_block(e.start + i);
+    }
+  }
+}
 
-inode_manager::inode_manager() {
-  bm = new block_manager();
-  uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
-  if (root_dir != 1) {
-    printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
-    exit(0);
+/* Undo a change to a file's map that could not be stored: free the blocks
+ * that now maps and before did not, which the change allocated. */
+void inode_manager::discard_fresh(const std::vector<extent_t> &now,
+                                  const std::vector<extent_t> &before) {
+  std::vector<std::pair<blockid_t, uint32_t>> old;
+  for (const auto &e : before) {
+    old.push_back({e.start, e.len});
+  }
+  std::sort(old.begin(), old.end());
+  for (const auto &e : now) {
+    for (uint32_t i = 0; i < e.len; ++i) {
+      auto id = e.start + i;
+      auto it = std::upper_bound(old.begin(), old.end(),
+                                 std::make_pair(id, UINT32_MAX));
+      if (it == old.begin() || (it - 1)->first + (it - 1)->second <= id) {
+        bm->free_block(id);
+      }
+    }
   }
 }
 
-/* Create a new file.
- * Return its inum. */
-uint32_t inode_manager::alloc_inode(uint32_t type) {
-  auto id = bm->alloc_block();
-  auto *buf = static_cast<char *>(malloc(BLOCK_SIZE));
-  bm->read_block(id, buf);
-  auto *i = reinterpret_cast<inode *>(buf);
-  i->type = type;
-  i->size = 0;
-  i->ctime = time(nullptr);
-  i->mtime = time(nullptr);
-  i->atime = time(nullptr);
-  bm->write_block(id, buf);
-  free(buf);
-  return id - 1 - bm->sb.nblocks / BPB;
+/* Give the mapped blocks of file blocks [first, last) that another file or
+ * a snapshot may still read fresh copies, so they can be written in place.
+ * The old blocks are added to dropped, as unmap_range does. Return false
+ * if the disk is full, leaving the caller to discard_fresh. */
+bool inode_manager::unshare_range(std::vector<extent_t> &exts, uint32_t first,
+                                  uint32_t last, blockid_t goal,
+                                  std::vector<extent_t> *dropped) {
+  // Runs of shared blocks, contiguous both in the file and on disk.
+  std::vector<extent_t> runs;
+  for (const auto &e : exts) {
+    auto lo = MAX(e.lblock, first);
+    auto hi = MIN(e.lblock + e.len, last);
+    for (auto lblock = lo; lblock < hi; ++lblock) {
+      auto id = e.start + lblock - e.lblock;
+      if (!bm->shared(id)) {
+        continue;
+      }
+      auto *r = runs.empty() ? nullptr : &runs.back();
+      if (r != nullptr && r->lblock + r->len == lblock &&
+          r->start + r->len == id) {
+        ++r->len;
+      } else {
+        runs.push_back({lblock, id, 1});
+      }
+    }
+  }
+
+  auto bs = bm->sb.block_size;
+  const uint32_t chunk = 64;
+  std::vector<char> buf(chunk * bs);
+  for (const auto &r : runs) {
+    // The file keeps its reference to the old blocks until dropped is
+    // freed, so another file sharing them cannot write them in place while
+    // they are copied.
+    unmap_range(exts, r.lblock, r.lblock + r.len, dropped);
+    uint32_t added;
+    if (!map_range(exts, r.lblock, r.lblock + r.len, goal, &added)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < r.len; i += chunk) {
+      auto n = MIN(chunk, r.len - i);
+      bm->read_blocks(r.start + i, n, buf.data());
+      write_extents(exts, (r.lblock + i) * bs, n * bs, buf.data());
+    }
+  }
+  return true;
 }
 
-void inode_manager::free_inode(uint32_t inum) {
-  auto bid = IBLOCK(inum, BLOCK_NUM);
-  bm->free_block(bid);
+/* Move the contents of an inline file into a freshly mapped block 0, so
+ * the file can grow past NINLINE. The inode itself is not written. Return
+ * false, leaving the file inline, if the disk is full. */
+bool inode_manager::move_inline(uint32_t inum, inode *ino,
+                                std::vector<extent_t> &exts) {
+  std::vector<char> b(bm->sb.block_size);
+  memcpy(b.data(), INLINE_DATA(ino), ino->size);
+  exts.clear();
+  uint32_t added;
+  if (ino->size != 0 && !map_range(exts, 0, 1, data_goal(inum), &added)) {
+    return false;
+  }
+  if (ino->size != 0) {
+    write_extents(exts, 0, b.size(), b.data());
+  }
+  ino->flags &= ~INODE_INLINE;
+  bzero(ino->extents, sizeof(ino->extents));
+  ino->nextents = 0;
+  ino->index = 0;
+  return true;
 }
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
-struct inode *inode_manager::get_inode(uint32_t inum) {
-  auto buf = static_cast<char *>(malloc(BLOCK_SIZE));
-  auto bid = IBLOCK(inum, BLOCK_NUM);
-  bm->read_block(BBLOCK(bid), buf);
-  if (buf[(bid % BPB) / 8] & (1 << (bid & 0x7))) {
-    bm->read_block(bid, buf);
-    auto i = reinterpret_cast<inode *>(buf);
-    i->atime = time(nullptr);
-    bm->write_block(bid, buf);
-    return i;
-  } else {
-    free(buf);
-    return nullptr;
+/* Copy n bytes starting at file offset off out of the mapped blocks.
+ * Whole blocks of a run are read with one contiguous copy, and holes read
+ * as zeros. */
+void inode_manager::read_extents(const std::vector<extent_t> &exts,
+                                 uint32_t off, uint32_t n, char *buf) {
+  auto bs = bm->sb.block_size;
+  auto it = std::upper_bound(exts.begin(), exts.end(), off / bs, lblock_before);
+  if (it != exts.begin() && (it - 1)->lblock + (it - 1)->len > off / bs) {
+    --it;
+  }
+  for (auto pos = off; pos < off + n;) {
+    if (it == exts.end() || pos < uint64_t(it->lblock) * bs) {
+      auto stop = it == exts.end() ? off + n : MIN(off + n, it->lblock * bs);
+      bzero(buf + pos - off, stop - pos);
+      pos = stop;
+      continue;
+    }
+    auto stop = MIN(off + n, (it->lblock + it->len) * bs);
+    while (pos < stop) {
+      auto id = it->start + pos / bs - it->lblock;
+      auto boff = pos % bs;
+      if (boff == 0 && stop - pos >= bs) {
+        auto count = (stop - pos) / bs;
+        bm->read_blocks(id, count, buf + pos - off);
+        pos += count * bs;
+      } else {
+        auto len = MIN(bs - boff, stop - pos);
+        bm->read_bytes(id, boff, len, buf + pos - off);
+        pos += len;
+      }
+    }
+    ++it;
   }
 }
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+/* Copy n bytes into the mapped blocks at file offset off. The whole range
+ * must be mapped. */
+void inode_manager::write_extents(const std::vector<extent_t> &exts,
+                                  uint32_t off, uint32_t n, const char *buf) {
+  auto bs = bm->sb.block_size;
+  auto it = std::upper_bound(exts.begin(), exts.end(), off / bs, lblock_before);
+  --it;
+  for (auto pos = off; pos < off + n; ++it) {
+    auto stop = MIN(off + n, (it->lblock + it->len) * bs);
+    while (pos < stop) {
+      auto id = it->start + pos / bs - it->lblock;
+      auto boff = pos % bs;
+      if (boff == 0 && stop - pos >= bs) {
+        auto count = (stop - pos) / bs;
+        bm->write_blocks(id, count, buf + pos - off);
+        pos += count * bs;
+      } else {
+        auto len = MIN(bs - boff, stop - pos);
+        bm->write_bytes(id, boff, len, buf + pos - off);
+        pos += len;
+      }
+    }
+  }
+}
 
-/* Get all the data of a file by inum.
- * Return alloced data, should be freed by caller. */
-void inode_manager::read_file(uint32_t inum, char **buf_out, uint32_t *size) {
+/* Get all the data of a file by inum, as a read unless touch is false.
+ * The blocks are gathered straight into buf, so each byte is copied once. */
+void inode_manager::read_file(uint32_t inum, std::string &buf, bool touch) {
+  buf.clear();
+  std::shared_lock<std::shared_mutex> l(inode_lock(inum));
   auto *inode = get_inode(inum);
   if (inode == nullptr) {
     return;
   }
-  std::list<uint32_t> queue;
-  for (auto i = 0; i < NDIRECT && inode->blocks[i] != 0; ++i) {
-    queue.push_back(inode->blocks[i]);
-  }
-  auto *buf = static_cast<char *>(malloc(BLOCK_SIZE));
-
-  //==>>
-  //  auto fsize = inode->size;
-  //  auto blocks = (fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  //  while (queue.size() != blocks) {
-  //    bm->read_block(queue.front(), buf);
-  //    for (int i = 0; i < NINDIRECT && reinterpret_cast<uint32_t *>(buf)[i] !=
-  //    0;
-  //         ++i) {
-  //      queue.push_back(reinterpret_cast<uint32_t *>(buf)[i]);
-  //    }
-  //    queue.pop_front();
-  //  }
-  //==
-  if (queue.size() == NDIRECT) {
-    bm->read_block(queue.back(), buf);
-    queue.pop_back();
-    for (uint32_t i = 0;
-         i < NINDIRECT && reinterpret_cast<uint32_t *>(buf)[i] != 0; ++i) {
-      queue.push_back(reinterpret_cast<uint32_t *>(buf)[i]);
-    }
-  }
-  //==<<
-
-  *size = inode->size;
-  *buf_out = static_cast<char *>(malloc(inode->size));
-  uint32_t rsize = 0;
-  for (const auto &i : queue) {
-    auto s = *size > rsize ? *size - rsize : 0;
-    bm->read_block(i, *buf_out + rsize, s);
-    rsize += BLOCK_SIZE;
-  }
-  inode->atime = time(nullptr);
-  bm->write_block(IBLOCK(inum, BLOCK_NUM), reinterpret_cast<char *>(inode));
-  free(buf);
+  auto map = extent_map_of(inum, inode);
+
+  if (inode->flags & INODE_INLINE) {
+    buf.assign(INLINE_DATA(inode), inode->size);
+  } else if (inode->size != 0) {
+    buf.resize(inode->size);
+    read_extents(map->exts, 0, inode->size, &buf[0]);
+  }
+
+  if (touch) {
+    touch_atime(inum);
+  }
   free(inode);
 }
 
-/* alloc/free blocks if needed */
-void inode_manager::write_file(uint32_t inum, const char *buf, uint32_t size) {
-  /*
-   * your code goes here.
-   * note: write buf to blocks of inode inum.
-   * you need to consider the situation when the size of buf
-   * is larger or smaller than the size of original inode
-   */
+/* Replace the contents of a file. Return false, leaving the old contents,
+ * if the disk is full. */
+bool inode_manager::write_file(uint32_t inum, const char *buf, uint32_t size) {
+  std::unique_lock<std::shared_mutex> l(inode_lock(inum));
+  return store_file(inum, buf, size);
+}
+
+/* alloc/free blocks if needed
+ * Existing block mappings are kept and a kept block is rewritten only if
+ * its bytes changed. All-zero blocks become holes, and files of at most
+ * NINLINE bytes are kept in the inode instead. Every block is mapped
+ * before any is written, so a full disk, or a size past max_file_size(),
+ * fails the store with nothing changed and false returned.
+ * Caller holds the inode lock exclusively. */
+bool inode_manager::store_file(uint32_t inum, const char *buf, uint32_t size) {
+  if (size > max_file_size()) {
+    printf("\tim: error! file size %u is too large\n", size);
+    return false;
+  }
   auto *inode = get_inode(inum);
   if (inode == nullptr) {
-    return;
+    return true;
+  }
+  if (!prepare_write(inum, false)) {
+    free(inode);
+    return false;
+  }
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> chain;
+  load_extents(inum, inode, exts, chain);
+
+  auto goal = data_goal(inum);
+  auto before = exts;
+  std::vector<extent_t> dropped;
+  if (size <= NINLINE) {
+    // Small enough to live in the inode: give back every block.
+    unmap_range(exts, 0, UINT32_MAX, &dropped);
+    store_extents(inum, inode, exts, chain, goal);
+    inode->flags |= INODE_INLINE;
+    if (size != 0) {
+      memcpy(INLINE_DATA(inode), buf, size);
+    }
+  } else {
+    std::vector<std::pair<uint32_t, uint32_t>> writes;
+    if (!store_blocks(exts, buf, size, goal, &dropped, &writes) ||
+        !store_extents(inum, inode, exts, chain, goal)) {
+      discard_fresh(exts, before);
+      free(inode);
+      return false;
+    }
+    inode->flags &= ~INODE_INLINE;
+    auto bs = bm->sb.block_size;
+    std::vector<char> zeros(bs);
+    for (const auto &w : writes) {
+      auto start = w.first * bs;
+      auto stop = MIN(size, w.second * bs);
+      write_extents(exts, start, stop - start, buf + start);
+      if (stop < w.second * bs) {
+        write_extents(exts, stop, w.second * bs - stop, zeros.data());
+      }
+    }
   }
 
-  std::deque<uint32_t> blocks;
-  for (int i = 0; i < NDIRECT && inode->blocks[i] != 0; ++i) {
-    blocks.push_back(inode->blocks[i]);
-  }
-  auto *b = static_cast<char *>(malloc(BLOCK_SIZE));
-  //==>>
-  //  while (blocks.size() != old_blocks) {
-  //    bm->read_block(blocks.front(), b);
-  //    for (int i = 0; i < NINDIRECT && reinterpret_cast<uint32_t *>(b)[i] !=
-  //    0;
-  //         ++i) {
-  //      blocks.push_back(reinterpret_cast<uint32_t *>(b)[i]);
-  //    }
-  //    bm->free_block(blocks.front());
-  //    blocks.pop_front();
-  //  }
-  //====
-  if (blocks.size() == NDIRECT) {
-    bm->read_block(blocks.back(), b);
-    bm->free_block(blocks.back());
-    blocks.pop_back();
-    for (uint32_t i = 0;
-         i < NINDIRECT && reinterpret_cast<uint32_t *>(b)[i] != 0; ++i) {
-      if (reinterpret_cast<uint32_t *>(b)[i] < BLOCK_NUM) {
-        blocks.push_back(reinterpret_cast<uint32_t *>(b)[i]);
+  inode->size = size;
+  inode->ctime = time(nullptr);
+  inode->mtime = time(nullptr);
+  put_inode(inum, inode);
+  free(inode);
+  free_extents(dropped);
+  return true;
+}
+
+/* Map the blocks of a file of size bytes from buf into exts, as store_file
+ * does, without writing any: the runs of file blocks [first, last) whose
+ * bytes have to be written are added to writes. Blocks no longer mapped
+ * are added to dropped, as unmap_range does. Return false if the disk is
+ * full, leaving the caller to discard_fresh. */
+bool inode_manager::store_blocks(
+    std::vector<extent_t> &exts, const char *buf, uint32_t size,
+    blockid_t goal, std::vector<extent_t> *dropped,
+    std::vector<std::pair<uint32_t, uint32_t>> *writes) {
+  auto bs = bm->sb.block_size;
+  auto new_blocks = (size + bs - 1) / bs;
+  unmap_range(exts, new_blocks, UINT32_MAX, dropped);
+
+  std::vector<char> b(bs);
+  std::vector<char> nb(bs);
+  for (uint32_t bn = 0; bn < new_blocks;) {
+    uint32_t n = MIN(bs, size - bn * bs);
+    if (is_zero(buf + bn * bs, n)) {
+      if (find_extent(exts, bn) != nullptr) {
+        unmap_range(exts, bn, bn + 1, dropped);
+      }
+      ++bn;
+      continue;
+    }
+    bzero(nb.data(), bs);
+    memcpy(nb.data(), buf + bn * bs, n);
+    if (const auto *e = find_extent(exts, bn)) {
+      auto id = e->start + bn - e->lblock;
+      bm->read_block(id, b.data());
+      if (memcmp(b.data(), nb.data(), bs) == 0) {
+        ++bn;
+        continue;
       }
+      if (!bm->shared(id)) {
+        writes->push_back({bn, bn + 1});
+        ++bn;
+        continue;
+      }
+      // Someone else still reads the old block: write a new one instead.
+      unmap_range(exts, bn, bn + 1, dropped);
+    }
+
+    // A run of unmapped blocks with data is allocated at once.
+    auto end = bn + 1;
+    while (end < new_blocks && find_extent(exts, end) == nullptr &&
+           !is_zero(buf + end * bs, MIN(bs, size - end * bs))) {
+      ++end;
+    }
+    uint32_t added;
+    if (!map_range(exts, bn, end, goal, &added)) {
+      return false;
     }
+    writes->push_back({bn, end});
+    bn = end;
+  }
+  return true;
+}
+
+/* Read at most n bytes starting at off into buf, touching only the blocks
+ * in range. */
+void inode_manager::read_range(uint32_t inum, uint32_t off, uint32_t n,
+                               std::string &buf) {
+  buf.clear();
+  std::shared_lock<std::shared_mutex> l(inode_lock(inum));
+  auto *inode = get_inode(inum);
+  if (inode == nullptr) {
+    return;
+  }
+  if (off >= inode->size || n == 0) {
+    free(inode);
+    return;
+  }
+  n = MIN(n, inode->size - off);
+  auto map = extent_map_of(inum, inode);
+
+  if (inode->flags & INODE_INLINE) {
+    buf.assign(INLINE_DATA(inode) + off, n);
+  } else {
+    buf.resize(n);
+    read_extents(map->exts, off, n, &buf[0]);
+  }
+
+  touch_atime(inum);
+  free(inode);
+}
+
+/* Write n bytes at off, growing the file if needed.
+ * Only the blocks covering [off, off + n) are allocated and written; a gap
+ * past the old end of file is left as a hole. Return false, with the file
+ * unchanged, if the disk is full or the write would end past
+ * max_file_size(). */
+bool inode_manager::write_range(uint32_t inum, uint32_t off, const char *buf,
+                                uint32_t n) {
+  auto bs = bm->sb.block_size;
+  if (off > max_file_size() || n > max_file_size() - off) {
+    printf("\tim: error! write of %u bytes at %u is too large\n", n, off);
+    return false;
+  }
+  std::unique_lock<std::shared_mutex> l(inode_lock(inum));
+  auto *inode = get_inode(inum);
+  if (inode == nullptr) {
+    return true;
+  }
+  if (n == 0) {
+    free(inode);
+    return true;
+  }
+  if (!prepare_write(inum, false)) {
+    free(inode);
+    return false;
+  }
+  auto end = off + n;
+  if ((inode->flags & INODE_INLINE) && end <= NINLINE) {
+    memcpy(INLINE_DATA(inode) + off, buf, n);
+    inode->size = MAX(inode->size, end);
+    inode->ctime = time(nullptr);
+    inode->mtime = time(nullptr);
+    put_inode(inum, inode);
+    free(inode);
+    return true;
+  }
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> chain;
+  load_extents(inum, inode, exts, chain);
+  auto before = exts;
+  bool was_inline = inode->flags & INODE_INLINE;
+  if (was_inline && !move_inline(inum, inode, exts)) {
+    free(inode);
+    return false;
+  }
+
+  auto first = off / bs;
+  auto last = (end + bs - 1) / bs;
+  bool head_fresh = off % bs != 0 && find_extent(exts, first) == nullptr;
+  bool tail_fresh = end % bs != 0 && find_extent(exts, last - 1) == nullptr;
+  auto goal = data_goal(inum);
+  uint32_t added;
+  std::vector<extent_t> dropped;
+  if (!unshare_range(exts, first, last, goal, &dropped) ||
+      !map_range(exts, first, last, goal, &added) ||
+      ((added != 0 || was_inline || !dropped.empty()) &&
+       !store_extents(inum, inode, exts, chain, goal))) {
+    // Out of space: fail the whole write, leaving the file as it was.
+    discard_fresh(exts, before);
+    free(inode);
+    return false;
+  }
+  // Fresh blocks hold stale bytes; zero whatever the write leaves out.
+  std::vector<char> zeros(bs);
+  if (head_fresh) {
+    write_extents(exts, first * bs, off % bs, zeros.data());
+  }
+  if (tail_fresh) {
+    write_extents(exts, end, last * bs - end, zeros.data());
+  }
+  write_extents(exts, off, n, buf);
+
+  inode->size = MAX(inode->size, end);
+  inode->ctime = time(nullptr);
+  inode->mtime = time(nullptr);
+  put_inode(inum, inode);
+  free(inode);
+  free_extents(dropped);
+  return true;
+}
+
+/* Set the size of a file. Growing only moves the end of file, leaving a
+ * hole; shrinking frees the blocks past the new end. Return false, with
+ * the file unchanged, if size is past max_file_size() or the disk is full:
+ * a file leaving the inode needs a block, and so does a shared last block
+ * cut short. */
+bool inode_manager::truncate(uint32_t inum, uint32_t size) {
+  auto bs = bm->sb.block_size;
+  if (size > max_file_size()) {
+    printf("\tim: error! file size %u is too large\n", size);
+    return false;
+  }
+  std::unique_lock<std::shared_mutex> l(inode_lock(inum));
+  auto *inode = get_inode(inum);
+  if (inode == nullptr) {
+    return true;
+  }
+  if (!prepare_write(inum, false)) {
+    free(inode);
+    return false;
   }
-  //==<<
-  for (auto i : blocks) {
-    bm->free_block(i);
-  }
-  blocks.clear();
-  uint32_t wsize = 0;
-
-  //==>>
-  //  while (wsize < size && blocks.size()) {
-  //    auto i = bm->alloc_block_back();
-  //    bm->write_block(i, buf + wsize,
-  //                    size - wsize < BLOCK_SIZE ? size - wsize : BLOCK_SIZE);
-  //    wsize += BLOCK_SIZE;
-  //    blocks.push_back(i);
-  //  }
-  //  while (blocks.size() > NDIRECT) {
-  //    std::deque<uint32_t> nblocks;
-  //    while (blocks.size() >= NINDIRECT) {
-  //      auto i = bm->alloc_block_back();
-  //      bm->write_block(i, reinterpret_cast<const uint8_t *>(&blocks[0]));
-  //      nblocks.push_back(i);
-  //      blocks.erase(blocks.begin(), blocks.begin() + NINDIRECT);
-  //    }
-  //    auto i = bm->alloc_block_back();
-  //    bm->write_block(i, reinterpret_cast<uint8_t *>(&blocks[0]),
-  //                    sizeof(uint32_t) * blocks.size());
-  //    nblocks.push_back(i);
-  //    blocks = std::move(nblocks);
-  //  }
-  //====
-  while (wsize < size && blocks.size() < NDIRECT - 1) {
-    auto i = bm->alloc_block_back();
-    bm->write_block(i, buf + wsize, size - wsize);
-    wsize += BLOCK_SIZE;
-    blocks.push_back(i);
-  }
-
-  auto nb = std::vector<uint32_t>();
-  while (wsize < size) {
-    auto i = bm->alloc_block_back();
-    bm->write_block(i, buf + wsize, size - wsize);
-    wsize += BLOCK_SIZE;
-    nb.push_back(i);
-  }
-  if (!nb.empty()) {
-    auto i = bm->alloc_block_back();
-    bm->write_block(i, reinterpret_cast<const char *>(&nb[0]),
-                    sizeof(uint32_t) * nb.size());
-    blocks.push_back(i);
-  }
-  //==<<
-  bzero(inode->blocks, NDIRECT * sizeof(blockid_t));
-  for (uint32_t i = 0; i < blocks.size(); ++i) {
-    inode->blocks[i] = blocks[i];
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> chain;
+  std::vector<extent_t> dropped;
+  if (inode->flags & INODE_INLINE) {
+    if (size < inode->size) {
+      bzero(INLINE_DATA(inode) + size, inode->size - size);
+    } else if (size > NINLINE) {
+      if (!move_inline(inum, inode, exts) ||
+          !store_extents(inum, inode, exts, chain, data_goal(inum))) {
+        discard_fresh(exts, {});
+        free(inode);
+        return false;
+      }
+    }
+  } else if (size < inode->size) {
+    load_extents(inum, inode, exts, chain);
+    auto before = exts;
+    bool ok = size % bs == 0 || unshare_range(exts, size / bs, size / bs + 1,
+                                              data_goal(inum), &dropped);
+    if (ok) {
+      unmap_range(exts, (size + bs - 1) / bs, UINT32_MAX, &dropped);
+      ok = store_extents(inum, inode, exts, chain, data_goal(inum));
+    }
+    if (!ok) {
+      discard_fresh(exts, before);
+      free(inode);
+      return false;
+    }
+    // Bytes past the end of file are kept zero.
+    if (size % bs != 0 && find_extent(exts, size / bs) != nullptr) {
+      std::vector<char> zeros(bs);
+      write_extents(exts, size, bs - size % bs, zeros.data());
+    }
   }
+
   inode->size = size;
   inode->ctime = time(nullptr);
   inode->mtime = time(nullptr);
-  bm->write_block(IBLOCK(inum, BLOCK_NUM),
-                  reinterpret_cast<const char *>(inode));
+  put_inode(inum, inode);
+  free(inode);
+  free_extents(dropped);
+  return true;
+}
+
+/* Move the blocks of a fragmented file into one contiguous run at the
+ * start of its group, keeping every extent's file blocks, and free the old
+ * ones. Contents and times are unchanged. Return the number of blocks
+ * moved: 0 if the file is inline, already contiguous, or no free run is
+ * long enough. The old blocks may be reused right away: the image keeps
+ * them, and the map pointing at them, until a checkpoint writes both the
+ * new map and whatever reused them. */
+uint32_t inode_manager::relocate(uint32_t inum) {
+  auto bs = bm->sb.block_size;
+  std::unique_lock<std::shared_mutex> l(inode_lock(inum));
+  auto *inode = get_inode(inum);
+  if (inode == nullptr) {
+    return 0;
+  }
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> chain;
+  load_extents(inum, inode, exts, chain);
+  if (count_runs(exts) <= 1) {
+    free(inode);
+    return 0;
+  }
+  // Moving blocks shared with a clone or a snapshot would only duplicate
+  // them.
+  uint32_t total = 0;
+  for (const auto &e : exts) {
+    for (uint32_t i = 0; i < e.len; ++i) {
+      if (bm->shared(e.start + i)) {
+        free(inode);
+        return 0;
+      }
+    }
+    total += e.len;
+  }
+  auto start = bm->alloc_extent(data_goal(inum), total);
+  if (start == NO_BLOCK) {
+    free(inode);
+    return 0;
+  }
+  if (!prepare_write(inum, false)) {
+    free_extents({{0, start, total}});
+    free(inode);
+    return 0;
+  }
 
+  // Copy a bounded number of blocks at a time.
+  const uint32_t chunk = 64;
+  std::vector<char> buf(chunk * bs);
+  auto old = exts;
+  auto to = start;
+  for (auto &e : exts) {
+    for (uint32_t i = 0; i < e.len; i += chunk) {
+      auto n = MIN(chunk, e.len - i);
+      bm->read_blocks(e.start + i, n, buf.data());
+      bm->write_blocks(to + i, n, buf.data());
+    }
+    e.start = to;
+    to += e.len;
+  }
+  // Neighbours now adjacent both in the file and on disk become one.
+  std::vector<extent_t> merged;
+  for (const auto &e : exts) {
+    auto *last = merged.empty() ? nullptr : &merged.back();
+    if (last != nullptr && last->lblock + last->len == e.lblock) {
+      last->len += e.len;
+    } else {
+      merged.push_back(e);
+    }
+  }
+  if (!store_extents(inum, inode, merged, chain, start)) {
+    free_extents({{0, start, total}});
+    free(inode);
+    return 0;
+  }
+  put_inode(inum, inode);
   free(inode);
-  free(b);
+  free_extents(old);
+  return total;
+}
+
+/* Survey the layout of every file on the disk. */
+void inode_manager::layout(layout_stats &st) {
+  bzero(&st, sizeof(st));
+  for (uint32_t inum = 1; inum <= bm->sb.ninodes; ++inum) {
+    std::shared_lock<std::shared_mutex> l(inode_lock(inum));
+    auto *inode = get_inode(inum);
+    if (inode == nullptr) {
+      continue;
+    }
+    auto map = extent_map_of(inum, inode);
+    free(inode);
+    if (map->exts.empty()) {
+      continue;
+    }
+    auto runs = count_runs(map->exts);
+    ++st.files;
+    st.fragmented += runs > 1;
+    st.runs += runs;
+    for (const auto &e : map->exts) {
+      st.blocks += e.len;
+    }
+  }
+  st.free = bm->free_blocks();
+}
+
+/* Make file dst a copy of file src by mapping the same blocks, each with
+ * one more reference; the first write to a shared block gives the writer
+ * its own copy. Only dst's extent tree is new. Return false if either file
+ * does not exist or there is no room for dst's tree. */
+bool inode_manager::clone(uint32_t src, uint32_t dst) {
+  if (src == dst) {
+    auto *ino = get_inode(src);
+    bool found = ino != nullptr;
+    free(ino);
+    return found;
+  }
+  // Lock in address order, as snapshot() does.
+  auto &src_lock = inode_lock(src);
+  auto &dst_lock = inode_lock(dst);
+  std::shared_lock<std::shared_mutex> sl;
+  std::unique_lock<std::shared_mutex> dl;
+  if (&src_lock == &dst_lock) {
+    dl = std::unique_lock<std::shared_mutex>(dst_lock);
+  } else if (&src_lock < &dst_lock) {
+    sl = std::shared_lock<std::shared_mutex>(src_lock);
+    dl = std::unique_lock<std::shared_mutex>(dst_lock);
+  } else {
+    dl = std::unique_lock<std::shared_mutex>(dst_lock);
+    sl = std::shared_lock<std::shared_mutex>(src_lock);
+  }
+  auto *from = get_inode(src);
+  auto *to = get_inode(dst);
+  if (from == nullptr || to == nullptr || !prepare_write(dst, false)) {
+    free(from);
+    free(to);
+    return false;
+  }
+
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> chain;
+  std::vector<extent_t> dropped;
+  load_extents(dst, to, exts, chain);
+  unmap_range(exts, 0, UINT32_MAX, &dropped);
+  auto goal = data_goal(dst);
+  if (from->flags & INODE_INLINE) {
+    store_extents(dst, to, exts, chain, goal);
+    to->flags |= INODE_INLINE;
+    memcpy(INLINE_DATA(to), INLINE_DATA(from), NINLINE);
+  } else {
+    auto map = extent_map_of(src, from);
+    for (const auto &e : map->exts) {
+      for (uint32_t i = 0; i < e.len; ++i) {
+        bm->share_block(e.start + i);
+      }
+    }
+    if (!store_extents(dst, to, map->exts, chain, goal)) {
+      free_extents(map->exts);
+      free(from);
+      free(to);
+      return false;
+    }
+    to->flags &= ~INODE_INLINE;
+  }
+
+  to->size = from->size;
+  to->ctime = time(nullptr);
+  to->mtime = time(nullptr);
+  put_inode(dst, to);
+  free(from);
+  free(to);
+  free_extents(dropped);
+  return true;
 }
 
 void inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a) {
@@ -355,28 +2354,55 @@ void inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a) {
   free(inode);
 }
 
-void inode_manager::remove_file(uint32_t inum) {
+/* Free the blocks and the inode of file inum. Return false, with the file
+ * left as it is, if the disk has no room to keep the inode blocks it
+ * changes for a snapshot. */
+bool inode_manager::remove_file(uint32_t inum) {
   /*
    * your code goes here
    * note: you need to consider about both the data block and inode of the file
    */
-  write_file(inum, nullptr, 0);
-  char buf[BLOCK_SIZE] = {0};
-  bm->write_block(IBLOCK(inum, BLOCK_NUM), buf);
+  std::unique_lock<std::shared_mutex> l(inode_lock(inum));
+  if (!prepare_write(inum, true)) {
+    return false;
+  }
+  store_file(inum, nullptr, 0);
   free_inode(inum);
+  return true;
 }
 
+/* Allocate inode inum as a new file of the given type, as replaying its
+ * creation does. Replay may find the image holding the file already: a
+ * file of that type is left as it is, and any other one is emptied first
+ * so its blocks are not lost. */
 void inode_manager::occupy_inode(uint32_t inum, uint32_t type) {
-  auto id = IBLOCK(inum, BLOCK_NUM);
-  bm->occupy_block(id);
-  auto *buf = static_cast<char *>(malloc(BLOCK_SIZE));
-  bm->read_block(id, buf);
-  auto *i = reinterpret_cast<inode *>(buf);
-  i->type = type;
-  i->size = 0;
-  i->ctime = time(nullptr);
-  i->mtime = time(nullptr);
-  i->atime = time(nullptr);
-  bm->write_block(id, buf);
-  free(buf);
+  std::unique_lock<std::shared_mutex> il(inode_lock(inum));
+  auto *inode = get_inode(inum);
+  bool existed = inode != nullptr;
+  if (existed) {
+    bool same = inode->type == type;
+    free(inode);
+    if (same) {
+      return;
+    }
+  }
+  if (!prepare_write(inum, true)) {
+    printf("\tim: error! no space to replay the creation of inode %u\n", inum);
+    return;
+  }
+  if (existed) {
+    store_file(inum, nullptr, 0);
+  }
+  std::unique_lock<std::mutex> l(m_);
+  mark_inode(inum, true);
+  auto &ino = cached_inode(inum);
+  bzero(&ino, sizeof(ino));
+  ino.type = type;
+  ino.flags = INODE_INLINE;
+  ino.ctime = time(nullptr);
+  ino.mtime = time(nullptr);
+  ino.atime = time(nullptr);
+  idirty_.insert(IBLOCK(inum, bm->sb));
+  std::unique_lock<std::mutex> el(emap_m_);
+  emaps_.erase(inum);
 }
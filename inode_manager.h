@@ -5,75 +5,320 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "extent_protocol.h"
 
+// Default geometry, used unless another one is given at format time.
 #define DISK_SIZE (1024 * 1024 * 16)
 #define BLOCK_SIZE 512
-#define BLOCK_NUM (DISK_SIZE / BLOCK_SIZE)
+#define INODE_NUM 1024
+
+// Buffer cache size in blocks, and the number of independently locked
+// shards it is split into.
+#define CACHE_BLOCKS 1024
+#define NCACHE_SHARDS 16
 
 typedef uint32_t blockid_t;
 
+// What the block allocators return when the disk is full. Block 0 is the
+// boot block, so it cannot mean that; this is past any disk's last block.
+#define NO_BLOCK UINT32_MAX
+
 // disk layer -----------------------------------------
 
+// Blocks of a disk as they stood at a checkpoint, on their way to the
+// image: their ids in ascending order and their contents back to back.
+struct disk_update {
+  std::vector<blockid_t> ids;
+  std::vector<char> data;
+};
+
 class disk {
  private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+  uint32_t block_size;
+  uint64_t size;
+  unsigned char *blocks;
+  // Backing image file, -1 if the disk only lives in memory or the image
+  // has not been saved yet.
+  int fd;
+  // Whether the image already held data when it was opened.
+  bool existed;
+  // Blocks written since the image was last saved are marked in dirty_,
+  // one bit each, and save() writes just those back in place, redo-logged
+  // in journal_ first.
+  std::string image;
+  std::unique_ptr<std::atomic<uint64_t>[]> dirty_;
+  int journal_;
+  // The file a new image is mapped from until its first save, -1 after.
+  int new_;
+
+  void map(int f);
+  void map_new();
+  void mark(blockid_t id, uint32_t count);
+  void redo_journal();
 
  public:
-  disk();
+  disk(uint32_t block_size, uint32_t nblocks, const std::string &image = "");
+  bool image_existed() const { return existed; }
+  void take_dirty(disk_update &u);
+  void save(const disk_update &u);
+  uint32_t release_unit() const;
+  void release(blockid_t id);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void read_blocks(uint32_t id, uint32_t count, char *buf);
+  void write_blocks(uint32_t id, uint32_t count, const char *buf);
+  void read_bytes(uint32_t id, uint32_t off, uint32_t n, char *buf);
+  void write_bytes(uint32_t id, uint32_t off, uint32_t n, const char *buf);
 };
 
 // block layer -----------------------------------------
 
+// Write-back cache of disk blocks in front of the disk. Blocks are spread
+// over shards by id; each shard evicts with CLOCK among unpinned frames.
+// Dirty blocks reach the disk when evicted or at flush.
+class buffer_cache {
+ private:
+  struct frame {
+    blockid_t id = 0;
+    bool valid = false;
+    bool dirty = false;
+    // CLOCK reference bit.
+    bool ref = false;
+    uint32_t pins = 0;
+  };
+  struct shard {
+    std::mutex m;
+    std::vector<frame> frames;
+    // Frame contents, frames.size() blocks back to back.
+    std::vector<uint64_t> data;
+    std::unordered_map<blockid_t, uint32_t> map;
+    uint32_t hand;
+  };
+
+  disk *d_;
+  uint32_t block_size_;
+  std::unique_ptr<shard[]> shards_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  // Frames whose contents are newer than the disk.
+  std::atomic<uint32_t> dirty_;
+
+  shard &shard_of(blockid_t id) { return shards_[id % NCACHE_SHARDS]; }
+  char *frame_data(shard &s, uint32_t f);
+  uint32_t lookup(shard &s, blockid_t id, bool load);
+
+ public:
+  buffer_cache(disk *d, uint32_t block_size, uint32_t nframes);
+  char *pin(blockid_t id);
+  void unpin(blockid_t id, bool dirty);
+  void read(blockid_t id, uint32_t off, uint32_t n, char *buf);
+  void write(blockid_t id, uint32_t off, uint32_t n, const char *buf);
+  void read_blocks(blockid_t id, uint32_t count, char *buf);
+  void write_blocks(blockid_t id, uint32_t count, const char *buf);
+  void flush();
+  void release(const disk_update &u);
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+  uint32_t dirty() const { return dirty_; }
+};
+
+#define SB_MAGIC 0x63686633  // "chf3"
+
+// Snapshots kept at once.
+#define NSNAPSHOTS 16
+
+typedef struct snapshot {
+  uint32_t id;       // Generation it froze
+  uint32_t time;
+  blockid_t copies;  // First block of its table of preserved inode blocks
+} snapshot_t;
+
 typedef struct superblock {
-  uint32_t size;
+  uint32_t magic;
+  uint64_t size;
   uint32_t nblocks;
   uint32_t ninodes;
+  uint32_t block_size;
+  // Bumped by every snapshot. Blocks born before the newest snapshot kept
+  // may belong to a snapshot and are never written in place or freed.
+  uint32_t gen;
+  uint32_t nsnapshots;
+  snapshot_t snapshots[NSNAPSHOTS];  // Oldest first
+  // Log position of the checkpoint that wrote the image: it holds every
+  // log record before it.
+  uint64_t lsn;
 } superblock_t;
 
+// Bookkeeping of one block, in the block table at the start of its group.
+typedef struct block_info {
+  uint32_t birth;  // Generation the block was allocated in
+  uint32_t refs;   // Files mapping it besides the first, through clones
+  // Generation the last file dropped it in while a snapshot kept it, 0
+  // while a file maps it. Snapshots birth < id <= death still see it.
+  uint32_t death;
+  uint32_t unused;  // Keeps an entry from straddling two blocks
+} block_info_t;
+
+// Bitmap bits per block
+#define BPB(bsize) ((bsize) * 8)
+
+// Number of bitmap blocks
+#define NBITMAP(nblocks, bsize) (((nblocks) + BPB(bsize) - 1) / BPB(bsize))
+
+// Block containing bit for block b
+#define BBLOCK(b, bsize) ((b) / BPB(bsize) + 2)
+
 class block_manager {
  private:
   disk *d;
-  std::mutex m_;
+  buffer_cache *cache_;
+  uint32_t nbitmap_;
+  // One lock per bitmap block, so allocations in different parts of the
+  // disk do not contend.
+  std::unique_ptr<std::mutex[]> bitmap_locks_;
+  // Rotating search cursor for alloc_block.
+  std::atomic<uint32_t> next_;
+  // Clear bits left in each bitmap block. Updated under the block's lock,
+  // read without it as a hint.
+  std::unique_ptr<std::atomic<uint32_t>[]> free_count_;
+
+  // Current snapshot generation, sb.gen, and the id of the newest snapshot
+  // kept, 0 if there is none.
+  std::atomic<uint32_t> gen_;
+  std::atomic<uint32_t> newest_;
+
+  uint64_t *pin_bitmap(uint32_t bb);
+  uint32_t alloc_from(uint32_t from);
+  void load_free_counts();
+  void info_block(uint32_t id, blockid_t *bid, uint32_t *off);
+  block_info_t read_info(uint32_t id);
+  void write_info(uint32_t id, const block_info_t &info);
+  void set_birth(uint32_t id, uint32_t n);
+  void clear_bit(uint32_t id);
 
  public:
-  block_manager();
+  block_manager(uint32_t block_size, uint64_t disk_size, uint32_t ninodes,
+                const std::string &image = "");
   struct superblock sb;
+  // True if an existing file system was mounted instead of formatted.
+  bool mounted;
 
   uint32_t alloc_block();
-  uint32_t alloc_block_back();
+  uint32_t alloc_near(uint32_t goal);
+  uint32_t alloc_run_at(uint32_t id, uint32_t n);
+  uint32_t alloc_run_near(uint32_t goal, uint32_t n, uint32_t *got);
+  uint32_t alloc_extent(uint32_t goal, uint32_t n);
   void occupy_block(uint32_t id);
   void free_block(uint32_t id);
+  void release_block(uint32_t id);
+  uint64_t free_blocks() const;
+  void new_generation();
+  uint64_t unpin_blocks();
+  bool shared(uint32_t id);
+  void share_block(uint32_t id);
+  void write_super();
   void read_block(uint32_t id, char *buf);
   void read_block(uint32_t id, char *buf, uint32_t n);
   void write_block(uint32_t id, const char *buf);
   void write_block(uint32_t id, const char *buf, uint32_t n);
+  void read_blocks(uint32_t id, uint32_t count, char *buf);
+  void write_blocks(uint32_t id, uint32_t count, const char *buf);
+  void read_bytes(uint32_t id, uint32_t off, uint32_t n, char *buf);
+  void write_bytes(uint32_t id, uint32_t off, uint32_t n, const char *buf);
+  void sync();
+  void checkpoint(disk_update &u);
+  void save(const disk_update &u);
+  const buffer_cache &cache() const { return *cache_; }
 };
 
 // inode layer -----------------------------------------
 
-#define INODE_NUM 1024
+// Number of striped per-inode reader/writer locks.
+#define NINODE_LOCKS 256
 
 // Inodes per block.
-#define IPB 1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB(bsize) ((bsize) / sizeof(struct inode))
+
+// Number of inode bitmap blocks, one bit per inode plus unused inode 0
+#define NIBITMAP(sb) \
+  (((sb).ninodes + BPB((sb).block_size)) / BPB((sb).block_size))
+
+// Block containing the inode bitmap bit for inode i
+#define IMAPBLOCK(i, sb) \
+  (NBITMAP((sb).nblocks, (sb).block_size) + (i) / BPB((sb).block_size) + 2)
+
+// Allocation groups, ext style. Each group covers the blocks of one bitmap
+// block (a smaller disk is a single group) and starts with its share of
+// the inode table; group 0 starts after the bitmaps. A file's blocks are
+// allocated from its inode's group first.
+#define NGROUPS(sb)                                  \
+  ((sb).nblocks < BPB((sb).block_size) ? 1           \
+                                       : (sb).nblocks / BPB((sb).block_size))
+
+// Inodes per group, and inode table blocks per group
+#define IPG(sb) (((sb).ninodes + NGROUPS(sb) - 1) / NGROUPS(sb))
+#define ITABLE(sb) ((IPG(sb) + IPB((sb).block_size) - 1) / IPB((sb).block_size))
+
+// First block of group g, and the group holding inode i
+#define GROUP_START(g, sb) \
+  ((g) == 0 ? IMAPBLOCK(0, sb) + NIBITMAP(sb) : (g) * BPB((sb).block_size))
+#define IGROUP(i, sb) (((i) - 1) / IPG(sb))
+
+// Each group starts with the block_info of each of its blocks, the last
+// group covering the tail of the disk too, then its inode table.
+#define BGROUP(b, sb)                                                   \
+  ((b) / BPB((sb).block_size) < NGROUPS(sb) ? (b) / BPB((sb).block_size) \
+                                            : NGROUPS(sb) - 1)
+#define GROUP_BLOCKS(g, sb)                                            \
+  ((g) + 1 == NGROUPS(sb) ? (sb).nblocks - (g) * BPB((sb).block_size) \
+                          : BPB((sb).block_size))
+#define NBINFO(g, sb)                                                   \
+  ((GROUP_BLOCKS(g, sb) * sizeof(block_info_t) + (sb).block_size - 1) / \
+   (sb).block_size)
+#define BINFO_OFFSET(b, sb) \
+  (((b) - BGROUP(b, sb) * BPB((sb).block_size)) * sizeof(block_info_t))
+#define ITABLE_START(g, sb) (GROUP_START(g, sb) + NBINFO(g, sb))
 
 // Block containing inode i
-#define IBLOCK(i, nblocks) ((nblocks) / BPB + (i - 1) / IPB + 2)
+#define IBLOCK(i, sb)                \
+  (ITABLE_START(IGROUP(i, sb), sb) + \
+   ((i) - 1) % IPG(sb) / IPB((sb).block_size))
 
-// Bitmap bits per block
-#define BPB (BLOCK_SIZE * 8)
+// Slot of inode i within its block
+#define ISLOT(i, sb) (((i) - 1) % IPG(sb) % IPB((sb).block_size))
 
-// Block containing bit for block b
-#define BBLOCK(b) ((b) / BPB + 2)
+// When reads update the access time of an inode.
+enum atime_mode {
+  ATIME_STRICT,    // on every read
+  ATIME_RELATIME,  // if older than mtime/ctime or a day old
+  ATIME_NOATIME,   // never
+};
+
+// Extents held directly in the inode.
+#define NEXTENT 8
+// Extents per leaf block of the extent tree.
+#define NEXTENT_BLOCK(bsize) \
+  (((bsize) - 2 * sizeof(uint32_t)) / sizeof(struct extent))
+// Entries per interior block of the extent tree.
+#define NINDEX_BLOCK(bsize) \
+  (((bsize) - 2 * sizeof(uint32_t)) / sizeof(struct extent_index))
+// Inodes whose resolved extent map is kept in memory.
+#define EMAP_CACHE 128
 
-#define NDIRECT 123
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint32_t))
-#define MAXFILE (NDIRECT + NINDIRECT)
+typedef struct extent {
+  uint32_t lblock;
+  blockid_t start;
+  uint32_t len;
+} extent_t;
 
 typedef struct inode {
   unsigned int type;
@@ -81,24 +326,160 @@ typedef struct inode {
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
+  uint32_t flags;
 
-  blockid_t blocks[NDIRECT];  // Data block addresses
+  uint32_t nextents;          // Extents in use, tree ones included
+  blockid_t index;            // Root of the extent tree, 0 if none
+  extent_t extents[NEXTENT];  // Leading extents, sorted by lblock
 } inode_t;
 
+// The file has no blocks: its contents live in place of the extents.
+#define INODE_INLINE 0x1
+// Largest file kept inline.
+#define NINLINE (NEXTENT * sizeof(extent_t))
+#define INLINE_DATA(ino) (reinterpret_cast<char *>((ino)->extents))
+
+// Extents past NEXTENT are kept in a tree of blocks rooted at the inode's
+// index. Leaves (level 0) hold extents; a block at level k > 0 holds the
+// first file block and id of each of its children at level k - 1.
+typedef struct extent_index {
+  uint32_t lblock;
+  blockid_t child;
+} extent_index_t;
+
+typedef struct extent_block {
+  uint32_t level;
+  uint32_t n;
+  extent_t extents[];  // NEXTENT_BLOCK(block size) of them at level 0
+} extent_block_t;
+
+#define EBLOCK_INDEX(eb) (reinterpret_cast<extent_index_t *>((eb)->extents))
+
+// All the extents of a file, sorted by lblock, and the tree blocks
+// holding those past NEXTENT.
+struct extent_map {
+  std::vector<extent_t> exts;
+  std::vector<blockid_t> index;
+};
+
+// How the data blocks of the files lie on the disk.
+struct layout_stats {
+  uint32_t files;       // Files with data blocks
+  uint32_t fragmented;  // Those spread over more than one disk run
+  uint64_t blocks;      // Data blocks in use
+  uint64_t runs;        // Contiguous disk runs the files are split into
+  uint64_t free;        // Free blocks
+};
+
 class inode_manager {
  private:
   block_manager *bm;
+  std::mutex m_;
+  // Inode table cache, one entry of IPB inodes per inode block.
+  std::unordered_map<blockid_t, std::vector<inode_t>> icache_;
+  // Inode blocks whose cached copy is newer than the disk.
+  std::set<blockid_t> idirty_;
+  // In-memory inode bitmap and its blocks newer than the disk.
+  std::vector<uint64_t> imap_;
+  std::set<blockid_t> imap_dirty_;
+  // Rotating search cursor for alloc_inode.
+  uint32_t next_inum_;
+  // File contents and extents are guarded by the inode's lock: shared to
+  // read, exclusive to write. m_ only guards the inode cache and bitmap.
+  std::unique_ptr<std::shared_mutex[]> ilocks_;
+  enum atime_mode atime_mode_;
+  // Resolved extent maps by inum, so a lookup is a search in memory
+  // instead of a walk of the extent tree. Entries change only under the
+  // inode's exclusive lock.
+  std::mutex emap_m_;
+  std::unordered_map<uint32_t, std::shared_ptr<const extent_map>> emaps_;
+  // Per snapshot, the copy of each inode bitmap and inode table block
+  // taken when the live block was first rewritten after it, 0 if none
+  // yet. Guarded by m_.
+  std::vector<std::vector<blockid_t>> snap_copies_;
+
+  void mark_inode(uint32_t inum, bool used);
+  void touch_atime(uint32_t inum);
+  blockid_t data_goal(uint32_t inum);
+  std::shared_mutex &inode_lock(uint32_t inum) {
+    return ilocks_[inum % NINODE_LOCKS];
+  }
+  bool store_file(uint32_t inum, const char *buf, uint32_t size);
+
+  struct inode &cached_inode(uint32_t inum);
   struct inode *get_inode(uint32_t inum);
+  void put_inode(uint32_t inum, const struct inode *ino);
+  void load_tree(blockid_t id, extent_map &m);
+  std::shared_ptr<const extent_map> extent_map_of(uint32_t inum,
+                                                  const inode *ino);
+  void load_extents(uint32_t inum, const inode *ino,
+                    std::vector<extent_t> &exts, std::vector<blockid_t> &chain);
+  bool store_extents(uint32_t inum, inode *ino,
+                     const std::vector<extent_t> &exts,
+                     std::vector<blockid_t> &chain, blockid_t goal);
+  bool map_range(std::vector<extent_t> &exts, uint32_t first, uint32_t last,
+                 blockid_t goal, uint32_t *added);
+  void unmap_range(std::vector<extent_t> &exts, uint32_t first, uint32_t last,
+                   std::vector<extent_t> *dropped);
+  void free_extents(const std::vector<extent_t> &exts);
+  void discard_fresh(const std::vector<extent_t> &now,
+                     const std::vector<extent_t> &before);
+  bool move_inline(uint32_t inum, inode *ino, std::vector<extent_t> &exts);
+  bool store_blocks(std::vector<extent_t> &exts, const char *buf,
+                    uint32_t size, blockid_t goal,
+                    std::vector<extent_t> *dropped,
+                    std::vector<std::pair<uint32_t, uint32_t>> *writes);
+  bool unshare_range(std::vector<extent_t> &exts, uint32_t first,
+                     uint32_t last, blockid_t goal,
+                     std::vector<extent_t> *dropped);
+  uint32_t meta_slot(blockid_t bid);
+  uint32_t nmeta();
+  bool preserve(blockid_t bid);
+  bool prepare_write(uint32_t inum, bool imap);
+  void write_meta();
+  void snapshot_block(uint32_t k, blockid_t bid, char *buf);
+  void read_extents(const std::vector<extent_t> &exts, uint32_t off,
+                    uint32_t n, char *buf);
+  void write_extents(const std::vector<extent_t> &exts, uint32_t off,
+                     uint32_t n, const char *buf);
 
  public:
-  inode_manager();
+  inode_manager(uint32_t block_size = BLOCK_SIZE,
+                uint64_t disk_size = DISK_SIZE, uint32_t ninodes = INODE_NUM,
+                const std::string &image = "");
   uint32_t alloc_inode(uint32_t type);
   void occupy_inode(uint32_t inum, uint32_t type);
   void free_inode(uint32_t inum);
-  void read_file(uint32_t inum, char **buf, uint32_t *size);
-  void write_file(uint32_t inum, const char *buf, uint32_t size);
-  void remove_file(uint32_t inum);
+  void read_file(uint32_t inum, std::string &buf, bool touch = true);
+  bool write_file(uint32_t inum, const char *buf, uint32_t size);
+  void read_range(uint32_t inum, uint32_t off, uint32_t n, std::string &buf);
+  bool write_range(uint32_t inum, uint32_t off, const char *buf, uint32_t n);
+  bool truncate(uint32_t inum, uint32_t size);
+  bool clone(uint32_t src, uint32_t dst);
+  bool remove_file(uint32_t inum);
   void get_attr(uint32_t inum, extent_protocol::attr &a);
+  uint32_t relocate(uint32_t inum);
+  void layout(layout_stats &st);
+  uint32_t snapshot();
+  bool delete_snapshot(uint32_t id);
+  uint32_t generation();
+  void list_snapshots(std::vector<snapshot_t> &snaps);
+  bool read_snapshot(uint32_t id, uint32_t inum, std::string &buf);
+  void flush();
+  void checkpoint(disk_update &u, uint64_t lsn = 0);
+  void save(const disk_update &u);
+  uint64_t checkpoint_lsn() const { return bm->sb.lsn; }
+  void set_atime_mode(enum atime_mode mode) { atime_mode_ = mode; }
+  bool mounted() const { return bm->mounted; }
+  uint32_t ninodes() const { return bm->sb.ninodes; }
+  uint32_t block_size() const { return bm->sb.block_size; }
+  // The largest file size: a whole number of blocks, so that rounding a
+  // size up to a block boundary stays within 32 bits.
+  uint32_t max_file_size() const {
+    return UINT32_MAX / bm->sb.block_size * bm->sb.block_size;
+  }
+  uint64_t free_blocks() const { return bm->free_blocks(); }
+  const buffer_cache &cache() const { return bm->cache(); }
 };
 
 #endif
@@ -1,14 +1,21 @@
 #pragma once
 
+#include <errno.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <mutex>
 #include <set>
 #include <utility>
 
+#include "crc32c.h"
 #include "extent_server.h"
 #include "rpc.h"
 
@@ -37,6 +44,13 @@ class chfs_command {
     CMD_PUT,
     CMD_REMOVE,
     CMD_ABORT,
+    CMD_WRITE,
+    CMD_TRUNCATE,
+    CMD_RELOCATE,
+    CMD_SNAPSHOT,
+    CMD_CLONE,
+    CMD_DELTA,
+    CMD_SNAPSHOT_DELETE,
   };
 
   txid_t txid_ = 0;
@@ -44,13 +58,39 @@ class chfs_command {
 
   cmd_type type_ = CMD_BEGIN;
 
-  // size | txid | inode | cmd_type | data
+  // size | crc | lsn | txid | inode | cmd_type | data
+  // size counts the bytes after itself. The CRC32C covers the record but
+  // for crc and lsn, then the lsn: the bulk is summed when the record is
+  // built, outside the log lock, and only the lsn once it is logged.
   std::string data_;
 
   std::string raw_data_;
 
+  uint32_t crc_ = 0;
+  // Position of the record in the log stream, set when it is logged.
+  uint64_t lsn_ = 0;
+  // CRC of everything but crc and lsn.
+  uint32_t body_crc_ = 0;
+
   uint32_t cursor_ = 0;
 
+  // Bytes ahead of the data, and where the part summed first starts.
+  static constexpr uint32_t header_size = 32;
+  static constexpr uint32_t body_offset = 16;
+
+  // CRC of the record at raw, lsn excluded; raw holds its whole header.
+  static uint32_t body_crc(const char *raw) {
+    uint32_t size;
+    memcpy(&size, raw, sizeof(size));
+    auto crc = crc32c(raw, sizeof(size));
+    return crc32c_extend(crc, raw + body_offset,
+                         sizeof(size) + size - body_offset);
+  }
+
+  static uint32_t record_crc(uint32_t body, uint64_t lsn) {
+    return crc32c_extend(body, &lsn, sizeof(lsn));
+  }
+
   void encode(const void *data, uint32_t size) {
     memcpy(&(raw_data_[cursor_]), data, size);
     cursor_ += size;
@@ -65,23 +105,39 @@ class chfs_command {
   chfs_command(txid_t txid, cmd_type type, uint32_t inum,
                const std::string &data)
       : txid_(txid), inum_(inum), type_(type), data_(data) {
-    uint32_t size = sizeof(txid) + sizeof(inum) + sizeof(type_) + data.size();
+    uint32_t size = header_size - sizeof(size) + data.size();
     raw_data_.resize(sizeof(size) + size);
 
     encode(&size, sizeof(size));
+    encode(&crc_, sizeof(crc_));
+    encode(&lsn_, sizeof(lsn_));
     encode(&txid_, sizeof(txid_));
     encode(&inum_, sizeof(inum_));
     encode(&type_, sizeof(type_));
     encode(data.data(), data.size());
+    body_crc_ = body_crc(raw_data_.data());
   }
   explicit chfs_command(std::string raw_data) : raw_data_(std::move(raw_data)) {
     uint32_t size = raw_data_.size();
-    data_.resize(size - sizeof(txid_) - sizeof(inum_) - sizeof(type_));
+    data_.resize(size - (header_size - sizeof(size)));
 
+    decode(&crc_, sizeof(crc_));
+    decode(&lsn_, sizeof(lsn_));
     decode(&txid_, sizeof(txid_));
     decode(&inum_, sizeof(inum_));
     decode(&type_, sizeof(type_));
     decode(&data_[0], data_.size());
+    // Keep the size prefix so into() gives back the logged bytes.
+    raw_data_.insert(0, reinterpret_cast<const char *>(&size), sizeof(size));
+    body_crc_ = body_crc(raw_data_.data());
+  }
+
+  // Stamp the record with its place in the log and seal it.
+  void set_lsn(uint64_t lsn) {
+    lsn_ = lsn;
+    crc_ = record_crc(body_crc_, lsn);
+    memcpy(&raw_data_[sizeof(uint32_t)], &crc_, sizeof(crc_));
+    memcpy(&raw_data_[sizeof(uint32_t) + sizeof(crc_)], &lsn_, sizeof(lsn_));
   }
 
   [[nodiscard]] std::string into() const { return raw_data_; }
@@ -89,6 +145,16 @@ class chfs_command {
   [[nodiscard]] uint64_t size() const { return data_.size(); }
 };
 
+// A record of the log being restored, read in place from the mapped file.
+struct log_record {
+  chfs_command::txid_t txid;
+  uint32_t inum;
+  chfs_command::cmd_type type;
+  uint64_t lsn;
+  const char *data;
+  uint32_t size;
+};
+
 /*
  * Your code here for Lab2A:
  * Implement class persister. A persister directly interacts with log files.
@@ -101,214 +167,336 @@ class chfs_command {
 template <typename command>
 class persister {
  public:
+  // The disk image is the checkpoint. The log only holds what happened
+  // since it was last written out.
   explicit persister(const std::string &file_dir);
-  ~persister() = default;
+  ~persister();
 
   // persist data into solid binary file
   // You may modify parameters in these functions
   void append_log(command log);
-  void checkpoint();
+  bool sync_log();
+  bool checkpoint(uint64_t lsn);
+  uint64_t lsn();
+  uint64_t log_bytes();
 
   // restore data from solid binary file
   // You may modify parameters in these functions
   void restore_logdata();
-  void restore_checkpoint();
+  void resume_at(uint64_t lsn);
+  void end_restore();
 
   [[nodiscard]] chfs_command::txid_t get_txid() const;
   void start_persist();
 
-  std::vector<command> bin_entries;
   std::vector<command> log_entries;
+  // The log as found at startup, valid until end_restore.
+  std::vector<log_record> restored;
 
  private:
   std::mutex mtx;
   std::string file_dir;
-  std::string file_path_checkpoint;
   std::string file_path_logfile;
   chfs_command::txid_t txid_;
   bool start = false;
+  // Bytes of the records in the log file.
+  uint64_t log_bytes_ = 0;
+  // Mapping of the log file during restore.
+  void *map_ = nullptr;
+  size_t map_size_ = 0;
+
+  // Group commit. Records are appended to pending_ in memory; sync_log
+  // makes one caller the leader, which writes everything pending with one
+  // write and one fdatasync while later callers queue behind it, then
+  // wakes them all. appended_ and durable_ count log bytes ever appended
+  // and ever made durable.
+  int log_fd_ = -1;
+  std::string pending_;
+  uint64_t appended_ = 0;
+  uint64_t durable_ = 0;
+  bool flushing_ = false;
+  std::condition_variable flushed_;
+  // A batch failed to reach the disk. The log may now end in a partial
+  // record, so nothing appended after it is ever reported durable.
+  bool failed_ = false;
+
+  static bool write_all(int fd, const std::string &raw);
 };
 
 template <typename command>
 persister<command>::persister(const std::string &dir) : txid_(0) {
   // DO NOT change the file names here
   file_dir = dir;
-  file_path_checkpoint = file_dir + "/checkpoint.bin";
   file_path_logfile = file_dir + "/logdata.bin";
 
-  int fpld = open(file_path_logfile.c_str(), O_CREAT | O_EXCL);
+  int fpld = open(file_path_logfile.c_str(), O_CREAT | O_EXCL, 0644);
   if (fpld > 0) {
     close(fpld);
   }
-  int fpcd = open(file_path_checkpoint.c_str(), O_CREAT | O_EXCL);
-  if (fpcd > 0) {
-    close(fpcd);
+}
+
+template <typename command>
+persister<command>::~persister() {
+  if (log_fd_ >= 0) {
+    write_all(log_fd_, pending_);
+    close(log_fd_);
   }
 }
 
+// Write all of raw, retrying short and interrupted writes. Return false
+// if the file refused some of it.
+template <typename command>
+bool persister<command>::write_all(int fd, const std::string &raw) {
+  size_t done = 0;
+  while (done < raw.size()) {
+    ssize_t w = write(fd, raw.data() + done, raw.size() - done);
+    if (w == -1 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return false;
+    }
+    done += w;
+  }
+  return true;
+}
+
+// Queue a record for the log. It is durable once sync_log returns.
 template <typename command>
 void persister<command>::append_log(command log) {
   if (!start) {
     return;
   }
-  log_entries.push_back(log);
+  std::lock_guard<std::mutex> l(mtx);
+  log.set_lsn(appended_);
   std::string raw = log.into();
-  int out = open(file_path_logfile.c_str(), O_WRONLY | O_APPEND);
-  if (out < 0) {
-    return;
-  }
-  while (true) {
-    ssize_t w = write(out, raw.data(), raw.size());
-    if (w >= 0 || (w == -1 && errno != EINTR)) {
-      break;
+  log_entries.push_back(std::move(log));
+  pending_ += raw;
+  appended_ += raw.size();
+  log_bytes_ += raw.size();
+}
+
+// The position the next record will be logged at.
+template <typename command>
+uint64_t persister<command>::lsn() {
+  std::lock_guard<std::mutex> l(mtx);
+  return appended_;
+}
+
+template <typename command>
+uint64_t persister<command>::log_bytes() {
+  std::lock_guard<std::mutex> l(mtx);
+  return log_bytes_;
+}
+
+// Wait until every record appended so far is on disk, writing them out as
+// the leader of a batch if no one else is. Return false if they could not
+// be written: every caller waiting on a failed batch, and every later one,
+// gets the error.
+template <typename command>
+bool persister<command>::sync_log() {
+  std::unique_lock<std::mutex> l(mtx);
+  auto target = appended_;
+  while (durable_ < target && !failed_) {
+    if (flushing_) {
+      flushed_.wait(l);
+      continue;
+    }
+    flushing_ = true;
+    std::string batch;
+    batch.swap(pending_);
+    auto end = appended_;
+    l.unlock();
+    bool ok = write_all(log_fd_, batch) && fdatasync(log_fd_) == 0;
+    l.lock();
+    if (ok) {
+      durable_ = end;
+    } else {
+      std::cout << __PRETTY_FUNCTION__ << ": cannot write the log: "
+                << strerror(errno) << std::endl;
+      failed_ = true;
     }
+    flushing_ = false;
+    flushed_.notify_all();
   }
-  close(out);
+  return durable_ >= target;
 }
 
+/* The disk image now holds everything logged before lsn and nothing of a
+ * transaction still open then. Cut the log at lsn, or at the first record
+ * of a transaction open at lsn if that comes earlier, and keep every
+ * record after the cut as it is, so replay applies them in the order they
+ * were logged. The shorter log is written aside and renamed over the old
+ * one, so a crash leaves one of the two whole. Return false if the log
+ * could not be rewritten; it is then left as it was. */
 template <typename command>
-void persister<command>::checkpoint() {
-  int out = open(file_path_checkpoint.c_str(), O_WRONLY | O_APPEND);
-  if (out < 0) {
-    return;
+bool persister<command>::checkpoint(uint64_t lsn) {
+  std::unique_lock<std::mutex> l(mtx);
+  // The log is replaced below; let a batch being written finish first.
+  flushed_.wait(l, [this] { return !flushing_; });
+  if (log_fd_ < 0 || failed_) {
+    return false;
   }
 
   std::set<chfs_command::txid_t> finished;
+  std::map<chfs_command::txid_t, uint64_t> first;
   for (const auto &i : log_entries) {
-    if (i.type_ == chfs_command::CMD_COMMIT) {
+    if (i.lsn_ >= lsn) {
+      break;
+    }
+    if (i.type_ == chfs_command::CMD_COMMIT ||
+        i.type_ == chfs_command::CMD_ABORT) {
       finished.insert(i.txid_);
     }
+    first.emplace(i.txid_, i.lsn_);
   }
-
-  for (const auto &i : log_entries) {
-    if (finished.count(i.txid_) != 0) {
-      switch (i.type_) {
-        case chfs_command::CMD_CREATE:
-        case chfs_command::CMD_PUT:
-        case chfs_command::CMD_REMOVE: {
-          auto raw = i.into();
-          while (true) {
-            ssize_t w = write(out, raw.data(), raw.size());
-            if (w >= 0 || (w == -1 && errno != EINTR)) {
-              break;
-            }
-          }
-          break;
-        }
-        case chfs_command::CMD_COMMIT:
-        case chfs_command::CMD_ABORT:
-        case chfs_command::CMD_BEGIN:
-        default:
-          break;
-      }
+  auto cut = lsn;
+  for (const auto &f : first) {
+    if (finished.count(f.first) == 0) {
+      cut = std::min(cut, f.second);
     }
   }
-
-  for (uint32_t i = 0; i < log_entries.size();) {
-    if (finished.count(log_entries[i].txid_) != 0) {
-      log_entries.erase(log_entries.begin() + i);
-    } else {
-      ++i;
-    }
+  size_t k = 0;
+  while (k < log_entries.size() && log_entries[k].lsn_ < cut) {
+    ++k;
+  }
+  if (k == 0) {
+    return true;
   }
 
-  out = open(file_path_logfile.c_str(), O_WRONLY | O_TRUNC);
+  std::string raw;
+  for (auto i = k; i < log_entries.size(); ++i) {
+    raw += log_entries[i].into();
+  }
+  auto tmp = file_path_logfile + ".tmp";
+  int out = open(tmp.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
   if (out < 0) {
-    return;
+    return false;
   }
-
-  for (const auto &i : log_entries) {
-    auto raw = i.into();
-    while (true) {
-      ssize_t w = write(out, raw.data(), raw.size());
-      if (w >= 0 || (w == -1 && errno != EINTR)) {
-        break;
-      }
-    }
+  if (!write_all(out, raw) || fdatasync(out) != 0 ||
+      rename(tmp.c_str(), file_path_logfile.c_str()) != 0) {
+    std::cout << __PRETTY_FUNCTION__ << ": cannot rewrite the log: "
+              << strerror(errno) << std::endl;
+    close(out);
+    unlink(tmp.c_str());
+    return false;
   }
-
-  close(out);
+  close(log_fd_);
+  log_fd_ = out;
+  log_entries.erase(log_entries.begin(), log_entries.begin() + k);
+  log_bytes_ = raw.size();
+  // Pending records were part of the rewrite.
+  pending_.clear();
+  durable_ = appended_;
+  flushed_.notify_all();
+  return true;
 }
 
+/* Map the log and index its records in place, so restoring copies
+ * nothing and the pages are read once, front to back. Each record is
+ * checked before its contents are trusted: it has to fit in the file, its
+ * CRC has to match and its LSN has to follow the previous one. The first
+ * record failing that is where a write was torn, and the log is cut
+ * there so new records do not land behind garbage. */
 template <typename command>
 void persister<command>::restore_logdata() {
-  int in = open(file_path_logfile.c_str(), O_RDONLY);
+  int in = open(file_path_logfile.c_str(), O_RDWR);
   if (in < 0) {
     return;
   }
-  while (true) {
-    uint32_t size;
-
-    ssize_t ar = read(in, &size, sizeof(size));
-    if (ar == -1 && errno == EINTR) {
-      continue;
-    }
-    if (ar != sizeof(size)) {
+  struct stat st;
+  if (fstat(in, &st) != 0 || st.st_size == 0) {
+    close(in);
+    return;
+  }
+  map_size_ = st.st_size;
+  map_ = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, in, 0);
+  if (map_ == MAP_FAILED) {
+    map_ = nullptr;
+    close(in);
+    return;
+  }
+  madvise(map_, map_size_, MADV_SEQUENTIAL);
+
+  const auto *base = static_cast<const char *>(map_);
+  const uint32_t header = command::header_size;
+  uint64_t off = 0;
+  while (off + header <= map_size_) {
+    const auto *p = base + off;
+    uint32_t size, crc;
+    memcpy(&size, p, sizeof(size));
+    memcpy(&crc, p + sizeof(size), sizeof(crc));
+    if (size < header - sizeof(size) || off + sizeof(size) + size > map_size_) {
       break;
     }
-
-    auto raw = std::string(size, 0);
-
-    ar = read(in, &raw[0], size);
-    if (ar == -1 && errno == EINTR) {
-      continue;
-    }
-    if (ar != size) {
+    log_record r;
+    memcpy(&r.lsn, p + sizeof(size) + sizeof(crc), sizeof(r.lsn));
+    if (command::record_crc(command::body_crc(p), r.lsn) != crc ||
+        (!restored.empty() && r.lsn < appended_)) {
       break;
     }
-
-    auto c = command(raw);
-    bin_entries.push_back(c);
-    txid_ = std::max(txid_, c.txid_);
+    memcpy(&r.txid, p + command::body_offset, sizeof(r.txid));
+    memcpy(&r.inum, p + command::body_offset + sizeof(r.txid), sizeof(r.inum));
+    memcpy(&r.type, p + command::body_offset + sizeof(r.txid) + sizeof(r.inum),
+           sizeof(r.type));
+    r.data = p + header;
+    r.size = sizeof(size) + size - header;
+    txid_ = std::max(txid_, r.txid);
+    restored.push_back(r);
+    appended_ = r.lsn + sizeof(size) + size;
+    off += sizeof(size) + size;
+  }
+  if (off < map_size_) {
+    std::cout << __PRETTY_FUNCTION__ << ": dropped "
+              << map_size_ - off << " bytes of torn log at offset " << off
+              << std::endl;
+    if (ftruncate(in, off) != 0 || fdatasync(in) != 0) {
+      std::cout << __PRETTY_FUNCTION__ << ": cannot cut the log" << std::endl;
+    }
   }
   close(in);
-  std::cout << __PRETTY_FUNCTION__ << ": restored " << log_entries.size()
+  durable_ = appended_;
+  log_bytes_ = off;
+  std::cout << __PRETTY_FUNCTION__ << ": restored " << restored.size()
             << " log entries from logfile" << std::endl;
   std::cout << __PRETTY_FUNCTION__ << ": set txid to " << txid_ << std::endl;
 }
 
+/* Log positions go on from lsn at least, the position the disk image
+ * covers, so records logged from now on sort after everything it holds
+ * even when its checkpoint left the log empty. */
 template <typename command>
-void persister<command>::restore_checkpoint() {
-  int in = open(file_path_checkpoint.c_str(), O_RDONLY);
-  if (in < 0) {
-    return;
-  }
-  while (true) {
-    uint32_t size;
-
-    ssize_t ar = read(in, &size, sizeof(size));
-    if (ar == -1 && errno == EINTR) {
-      continue;
-    }
-    if (ar != sizeof(size)) {
-      break;
-    }
-
-    auto raw = std::string();
-    raw.resize(size);
-    ar = read(in, &raw[0], size);
-    if (ar == -1 && errno == EINTR) {
-      continue;
-    }
-    if (ar != size) {
-      break;
-    }
+void persister<command>::resume_at(uint64_t lsn) {
+  std::lock_guard<std::mutex> l(mtx);
+  appended_ = std::max(appended_, lsn);
+  durable_ = std::max(durable_, lsn);
+}
 
-    auto c = command(raw);
-    bin_entries.push_back(c);
-    txid_ = std::max(txid_, c.txid_);
+/* Done replaying: keep the restored records, which stay in the log until
+ * a checkpoint cuts it, and drop the mapping. */
+template <typename command>
+void persister<command>::end_restore() {
+  // The raw form a command is decoded from starts after the size.
+  const uint32_t header = command::header_size - sizeof(uint32_t);
+  for (const auto &r : restored) {
+    log_entries.push_back(
+        command(std::string(r.data - header, header + r.size)));
+  }
+  restored.clear();
+  restored.shrink_to_fit();
+  if (map_ != nullptr) {
+    munmap(map_, map_size_);
+    map_ = nullptr;
   }
-  close(in);
-
-  std::cout << __PRETTY_FUNCTION__ << ": restored " << bin_entries.size()
-            << " log entries from checkpoint" << std::endl;
 }
+
 template <typename command>
 chfs_command::txid_t persister<command>::get_txid() const {
   return txid_;
 }
 template <typename command>
 void persister<command>::start_persist() {
+  log_fd_ = open(file_path_logfile.c_str(), O_WRONLY | O_APPEND);
   start = true;
 }
 
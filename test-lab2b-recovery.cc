@@ -0,0 +1,211 @@
+/*
+ * test-lab2b-recovery port command [args...]
+ *
+ * Talk to an extent server directly, one step at a time, so that
+ * test-lab2b-recovery.sh can kill and restart the server between steps
+ * and check what survived.
+ *
+ *   begin                    start a transaction, print its id
+ *   commit txid              commit a transaction
+ *   create txid              create a file in a transaction, print its inum
+ *   put txid inum data       set the contents of a file in a transaction
+ *   clone txid src dst       make dst share the contents of src
+ *   file data                create a file holding data and commit it
+ *   get inum                 print the contents of a file
+ *   read inum off size       print size bytes of a file from off
+ *   write txid inum off data write data into a file at off
+ *   truncate txid inum size  set the size of a file
+ *   remove txid inum         remove a file
+ *   type inum                print the type of a file, 0 if it is free
+ *   size inum                print the size of a file
+ *   free                     print the number of free blocks
+ *   stats                    print the server's stats
+ *   snapshot                 take a snapshot, print its id
+ *   snapshots                list the snapshots, one "id time" a line
+ *   snapshot-get id inum     print the contents of a file in a snapshot
+ *   snapshot-delete id       delete a snapshot
+ *   load n size              create and rewrite files of size bytes,
+ *                            n transactions, until the server goes away
+ *   clean                    remove every file but the root directory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sstream>
+#include <string>
+
+#include "extent_client.h"
+
+extent_client *ec;
+
+void check(extent_protocol::status ret, const char *what) {
+  if (ret != extent_protocol::OK) {
+    fprintf(stderr, "test-lab2b-recovery: %s failed: %d\n", what, ret);
+    exit(1);
+  }
+}
+
+chfs_command::txid_t begin() {
+  chfs_command::txid_t txid;
+  check(ec->start_tx(txid), "start_tx");
+  return txid;
+}
+
+extent_protocol::extentid_t create(chfs_command::txid_t txid) {
+  extent_protocol::extentid_t inum = 0;
+  check(ec->create(extent_protocol::T_FILE, txid, inum), "create");
+  if (inum == 0) {
+    fprintf(stderr, "test-lab2b-recovery: out of inodes\n");
+    exit(1);
+  }
+  return inum;
+}
+
+extent_protocol::attr attr(extent_protocol::extentid_t inum) {
+  extent_protocol::attr a{};
+  check(ec->getattr(inum, a), "getattr");
+  return a;
+}
+
+uint32_t type(extent_protocol::extentid_t inum) { return attr(inum).type; }
+
+/* Print file contents as they are, holes and all. */
+void print(const std::string &buf) {
+  fwrite(buf.data(), 1, buf.size(), stdout);
+  printf("\n");
+}
+
+uint64_t free_blocks() {
+  std::string out, name;
+  check(ec->stats(out), "stats");
+  std::istringstream is(out);
+  uint64_t v;
+  while (is >> name >> v) {
+    if (name == "free_blocks") {
+      return v;
+    }
+  }
+  fprintf(stderr, "test-lab2b-recovery: no free_blocks in stats\n");
+  exit(1);
+}
+
+/* Keep files of size bytes busy: create one, fill it, rewrite a part of
+ * an earlier one, and now and then remove one, a transaction each. */
+void load(int n, int size) {
+  std::string data(size, 0);
+  extent_protocol::extentid_t files[64];
+  int nfiles = 0;
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < size; k++) {
+      data[k] = 'a' + (i + k / 512) % 26;
+    }
+    auto txid = begin();
+    if (nfiles < 64) {
+      files[nfiles] = create(txid);
+      check(ec->put(files[nfiles], data, txid), "put");
+      nfiles++;
+    } else if (i % 7 == 0) {
+      auto k = i % nfiles;
+      check(ec->remove(files[k], txid), "remove");
+      files[k] = files[--nfiles];
+    } else {
+      check(ec->put(files[i % nfiles], data, txid), "put");
+    }
+    check(ec->commit_tx(txid), "commit_tx");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s port command [args...]\n", argv[0]);
+    exit(1);
+  }
+  setvbuf(stdout, NULL, _IONBF, 0);
+  ec = new extent_client(std::string("127.0.0.1:") + argv[1]);
+
+  std::string cmd = argv[2];
+  if (cmd == "begin" && argc == 3) {
+    printf("%llu\n", begin());
+  } else if (cmd == "commit" && argc == 4) {
+    check(ec->commit_tx(strtoull(argv[3], NULL, 0)), "commit_tx");
+  } else if (cmd == "create" && argc == 4) {
+    printf("%llu\n", create(strtoull(argv[3], NULL, 0)));
+  } else if (cmd == "put" && argc == 6) {
+    check(ec->put(strtoull(argv[4], NULL, 0), argv[5],
+                  strtoull(argv[3], NULL, 0)),
+          "put");
+  } else if (cmd == "clone" && argc == 6) {
+    check(ec->clone(strtoull(argv[4], NULL, 0), strtoull(argv[5], NULL, 0),
+                    strtoull(argv[3], NULL, 0)),
+          "clone");
+  } else if (cmd == "file" && argc == 4) {
+    auto txid = begin();
+    auto inum = create(txid);
+    check(ec->put(inum, argv[3], txid), "put");
+    check(ec->commit_tx(txid), "commit_tx");
+    printf("%llu\n", inum);
+  } else if (cmd == "get" && argc == 4) {
+    std::string buf;
+    check(ec->get(strtoull(argv[3], NULL, 0), buf), "get");
+    print(buf);
+  } else if (cmd == "read" && argc == 6) {
+    std::string buf;
+    check(ec->read_range(strtoull(argv[3], NULL, 0), strtoul(argv[4], NULL, 0),
+                         strtoul(argv[5], NULL, 0), buf),
+          "read_range");
+    print(buf);
+  } else if (cmd == "write" && argc == 7) {
+    check(ec->write_range(strtoull(argv[4], NULL, 0), strtoul(argv[5], NULL, 0),
+                          argv[6], strtoull(argv[3], NULL, 0)),
+          "write_range");
+  } else if (cmd == "truncate" && argc == 6) {
+    check(ec->truncate(strtoull(argv[4], NULL, 0), strtoul(argv[5], NULL, 0),
+                       strtoull(argv[3], NULL, 0)),
+          "truncate");
+  } else if (cmd == "remove" && argc == 5) {
+    check(ec->remove(strtoull(argv[4], NULL, 0), strtoull(argv[3], NULL, 0)),
+          "remove");
+  } else if (cmd == "type" && argc == 4) {
+    printf("%u\n", type(strtoull(argv[3], NULL, 0)));
+  } else if (cmd == "size" && argc == 4) {
+    printf("%u\n", attr(strtoull(argv[3], NULL, 0)).size);
+  } else if (cmd == "free" && argc == 3) {
+    printf("%llu\n", (unsigned long long)free_blocks());
+  } else if (cmd == "stats" && argc == 3) {
+    std::string out;
+    check(ec->stats(out), "stats");
+    printf("%s", out.c_str());
+  } else if (cmd == "snapshot" && argc == 3) {
+    uint32_t id;
+    check(ec->snapshot_create(id), "snapshot_create");
+    printf("%u\n", id);
+  } else if (cmd == "snapshots" && argc == 3) {
+    std::string out;
+    check(ec->snapshot_list(out), "snapshot_list");
+    printf("%s", out.c_str());
+  } else if (cmd == "snapshot-get" && argc == 5) {
+    std::string buf;
+    check(ec->snapshot_get(strtoul(argv[3], NULL, 0),
+                           strtoull(argv[4], NULL, 0), buf),
+          "snapshot_get");
+    print(buf);
+  } else if (cmd == "snapshot-delete" && argc == 4) {
+    check(ec->snapshot_delete(strtoul(argv[3], NULL, 0)), "snapshot_delete");
+  } else if (cmd == "load" && argc == 5) {
+    load(atoi(argv[3]), atoi(argv[4]));
+  } else if (cmd == "clean" && argc == 3) {
+    auto txid = begin();
+    for (extent_protocol::extentid_t inum = 2; inum <= INODE_NUM; inum++) {
+      if (type(inum) != 0) {
+        check(ec->remove(inum, txid), "remove");
+      }
+    }
+    check(ec->commit_tx(txid), "commit_tx");
+  } else {
+    fprintf(stderr, "test-lab2b-recovery: bad command %s\n", cmd.c_str());
+    exit(1);
+  }
+  return 0;
+}
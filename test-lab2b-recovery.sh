@@ -0,0 +1,310 @@
+#!/bin/bash
+
+##########################################
+#  this file contains:
+#   RECOVERY TEST: kill -9 the extent server at bad moments, restart it
+#   and check what the disk image and the log bring back
+###########################################
+
+BIN=$PWD
+DIR=$(mktemp -d /tmp/chfs-recovery.XXXXXX)
+PORT=$[RANDOM+2000]
+PID=
+
+cd $DIR
+trap 'kill -9 $PID >/dev/null 2>&1; rm -rf $DIR' EXIT
+
+client() {
+    $BIN/test-lab2b-recovery $PORT "$@"
+}
+
+start_server() {
+    $BIN/extent_server $PORT >>extent_server.log 2>&1 &
+    PID=$!
+    sleep 0.5
+}
+
+crash_server() {
+    kill -9 $PID >/dev/null 2>&1
+    wait $PID >/dev/null 2>&1
+}
+
+fresh_server() {
+    crash_server
+    rm -rf log
+    mkdir log
+    start_server
+}
+
+fail() {
+    echo "failed RECOVERY test: $1"
+    exit 1
+}
+
+echo "RECOVERY TEST"
+
+# Checkpoints run while a transaction is open. None of its work may end up
+# in the image.
+export CHFS_CHECKPOINT_MS=20
+fresh_server
+f=$(client file committed) || fail "file"
+tx=$(client begin) || fail "begin"
+g=$(client create $tx) || fail "create"
+client put $tx $g uncommitted || fail "put"
+client file more >/dev/null || fail "file"
+sleep 1
+crash_server
+start_server
+[ "$(client type $g)" = 0 ] || fail "uncommitted create survived a crash"
+[ "$(client get $f)" = committed ] || fail "committed put lost"
+
+# A transaction committed after a later one, with a checkpoint between the
+# two. The later put has to win after a restart too.
+fresh_server
+f=$(client file 0) || fail "file"
+tx1=$(client begin) || fail "begin"
+client put $tx1 $f 1 || fail "put"
+tx2=$(client begin) || fail "begin"
+client put $tx2 $f 2 || fail "put"
+client commit $tx2 || fail "commit"
+sleep 0.5
+client commit $tx1 || fail "commit"
+[ "$(client get $f)" = 2 ] || fail "wrong contents before the crash"
+crash_server
+start_server
+[ "$(client get $f)" = 2 ] || fail "replay reordered the puts"
+
+# A transaction left open past the timeout is aborted by a checkpoint.
+# What it did stays, as an abort's does, but whatever its client sends
+# afterwards has to be turned away rather than applied.
+fresh_server
+tx=$(client begin) || fail "begin"
+g=$(client create $tx) || fail "create"
+sleep 10.5
+client put $tx $g late 2>/dev/null && fail "put in an aborted transaction"
+client commit $tx 2>/dev/null && fail "commit of an aborted transaction"
+crash_server
+start_server
+[ "$(client get $g)" = "" ] || fail "put in an aborted transaction applied"
+
+# Crash under load again and again, then remove every file. All the blocks
+# have to come back.
+fresh_server
+free=$(client free) || fail "free"
+for i in 1 2 3 4 5; do
+    client load 100000 4096 >/dev/null 2>&1 &
+    LOAD=$!
+    sleep 0.$[RANDOM%8+2]
+    crash_server
+    kill -9 $LOAD >/dev/null 2>&1
+    wait $LOAD >/dev/null 2>&1
+    start_server
+done
+client clean || fail "clean"
+[ "$(client free)" = $free ] || fail "blocks leaked: $free free before, $(client free) after"
+
+# A crash in the middle of a log write leaves a torn record at the end,
+# here one whose size field is garbage, then random bytes. Recovery has to
+# stop right before it, and records logged after the restart must follow
+# what was kept, not the garbage.
+export CHFS_CHECKPOINT_MS=0
+fresh_server
+f=$(client file one) || fail "file"
+crash_server
+printf '\377\377\377\177torn' >>log/logdata.bin
+start_server
+[ "$(client get $f)" = one ] || fail "torn size field broke recovery"
+g=$(client file two) || fail "file"
+crash_server
+head -c 100 /dev/urandom >>log/logdata.bin
+start_server
+[ "$(client get $f)" = one ] || fail "record before a torn tail lost"
+[ "$(client get $g)" = two ] || fail "record logged after a torn tail lost"
+
+# A crash after a checkpoint wrote the image but before it cut the log
+# leaves records the image already holds. Replaying the clone again would
+# hand g what f holds now instead of what it held then.
+CHFS_CHECKPOINT_MS=20 fresh_server
+f=$(client file one) || fail "file"
+g=$(client file "") || fail "file"
+sleep 0.5
+crash_server
+start_server
+tx=$(client begin) || fail "begin"
+client clone $tx $f $g || fail "clone"
+client commit $tx || fail "commit"
+tx=$(client begin) || fail "begin"
+client put $tx $f two || fail "put"
+client commit $tx || fail "commit"
+cp log/logdata.bin logdata.old
+crash_server
+CHFS_CHECKPOINT_MS=20 start_server
+crash_server
+cp logdata.old log/logdata.bin
+start_server
+[ "$(client get $g)" = one ] || fail "log replayed over a newer image"
+[ "$(client get $f)" = two ] || fail "log replayed over a newer image"
+
+# A put that edits a file another transaction changed and never
+# committed must be logged in full. Replay skips the uncommitted change, so
+# a delta against it would leave a mix of both versions behind.
+export CHFS_CHECKPOINT_MS=0
+fresh_server
+a=$(printf 'a%.0s' {1..200})
+f=$(client file $a) || fail "file"
+tx1=$(client begin) || fail "begin"
+client put $tx1 $f ${a:1}b || fail "put"
+tx2=$(client begin) || fail "begin"
+client put $tx2 $f X${a:2}b || fail "put"
+client commit $tx2 || fail "commit"
+crash_server
+start_server
+[ "$(client get $f)" = X${a:2}b ] || fail "delta replayed against an uncommitted put"
+
+# The defragmenter moves files while they are read. Free space is cut into
+# holes first, so the files written next are split over several of them;
+# one has a hole of its own and one is small enough to stay in its inode.
+# Reads see the same bytes before, during and after the moves, and after
+# a crash.
+export CHFS_CHECKPOINT_MS=20
+CHFS_DEFRAG_MS=0 fresh_server
+small=$(head -c 2048 /dev/zero | tr '\0' s)
+big=$(head -c 6000 /dev/zero | tr '\0' b)
+files=
+for i in $(seq 64); do
+    files="$files $(client file $small)" || fail "file"
+done
+tx=$(client begin) || fail "begin"
+k=0
+for f in $files; do
+    k=$[k+1]
+    [ $[k%2] = 0 ] && { client remove $tx $f || fail "remove"; }
+done
+client commit $tx || fail "commit"
+bigs=
+for i in $(seq 16); do
+    bigs="$bigs $(client file $big)" || fail "file"
+done
+h=$(client file head) || fail "file"
+tx=$(client begin) || fail "begin"
+client write $tx $h 20000 tail || fail "write"
+client commit $tx || fail "commit"
+t=$(client file tiny) || fail "file"
+tx=$(client begin) || fail "begin"
+client write $tx $t 2 ZZ || fail "write"
+client commit $tx || fail "commit"
+[ "$(client stats | awk '$1 == "fragmented_files" { print $2 }')" -gt 0 ] ||
+    fail "churn left no file fragmented"
+sleep 0.5
+check_files() {
+    for g in $bigs; do
+        [ "$(client get $g)" = $big ] || fail "$1: wrong contents"
+    done
+    [ "$(client size $h)" = 20004 ] || fail "$1: wrong size of a sparse file"
+    [ "$(client read $h 0 4)" = head ] || fail "$1: sparse file lost its head"
+    [ "$(client read $h 10000 4 | od -An -tx1 | tr -d ' ')" = 000000000a ] ||
+        fail "$1: hole does not read as zeros"
+    [ "$(client read $h 20000 100)" = tail ] ||
+        fail "$1: sparse file lost its tail"
+    [ "$(client get $t)" = tiZZ ] || fail "$1: wrong contents of a small file"
+}
+crash_server
+CHFS_DEFRAG_MS=50 start_server
+for i in $(seq 10); do
+    check_files "during relocation"
+done
+[ "$(client stats | awk '$1 == "relocated_files" { print $2 }')" -gt 0 ] ||
+    fail "nothing relocated"
+crash_server
+start_server
+check_files "relocated, then crashed"
+
+# A snapshot keeps what files held when it was taken while they are
+# overwritten, cut short and removed, across crashes. Deleting it gives
+# back every block it kept.
+export CHFS_CHECKPOINT_MS=0
+fresh_server
+old=$(head -c 5000 /dev/zero | tr '\0' o)
+new=$(head -c 7000 /dev/zero | tr '\0' n)
+f=$(client file $old) || fail "file"
+g=$(client file $old) || fail "file"
+r=$(client file $old) || fail "file"
+free=$(client free) || fail "free"
+snap=$(client snapshot) || fail "snapshot"
+[ "$(client snapshots | cut -d' ' -f1)" = $snap ] || fail "snapshot not listed"
+crash_server
+start_server
+tx=$(client begin) || fail "begin"
+client put $tx $f $new || fail "put"
+client truncate $tx $g 100 || fail "truncate"
+client remove $tx $r || fail "remove"
+client commit $tx || fail "commit"
+crash_server
+start_server
+[ "$(client snapshots | cut -d' ' -f1)" = $snap ] ||
+    fail "snapshot lost in a crash"
+for x in $f $g $r; do
+    [ "$(client snapshot-get $snap $x)" = $old ] ||
+        fail "snapshot changed with the live file"
+done
+[ "$(client get $f)" = $new ] || fail "overwrite lost"
+[ "$(client size $g)" = 100 ] || fail "truncate lost"
+[ "$(client type $r)" = 0 ] || fail "remove lost"
+client snapshot-delete $snap || fail "snapshot-delete"
+[ -z "$(client snapshots)" ] || fail "deleted snapshot still listed"
+client snapshot-get $snap $f >/dev/null 2>&1 &&
+    fail "deleted snapshot still readable"
+tx=$(client begin) || fail "begin"
+client put $tx $f $old || fail "put"
+client truncate $tx $g 0 || fail "truncate"
+client put $tx $g $old || fail "put"
+r=$(client create $tx) || fail "create"
+client put $tx $r $old || fail "put"
+client commit $tx || fail "commit"
+crash_server
+start_server
+[ "$(client free)" = $free ] ||
+    fail "snapshot kept blocks: $free free before, $(client free) after"
+
+# A clone shares its source's blocks instead of copying them, and a write
+# to either side after a remount leaves the other as it was. Removing
+# both gives every block back.
+export CHFS_CHECKPOINT_MS=20
+fresh_server
+data=$(head -c 8000 /dev/zero | tr '\0' d)
+free=$(client free) || fail "free"
+f=$(client file $data) || fail "file"
+g=$(client file "") || fail "file"
+used=$[free - $(client free)]
+tx=$(client begin) || fail "begin"
+client clone $tx $f $g || fail "clone"
+client commit $tx || fail "commit"
+[ $[free - $(client free)] -lt $[used + 4] ] || fail "clone copied blocks"
+sleep 0.5
+crash_server
+start_server
+[ "$(client get $g)" = $data ] || fail "clone lost in a remount"
+tx=$(client begin) || fail "begin"
+client write $tx $g 100 XYZ || fail "write"
+client commit $tx || fail "commit"
+tx=$(client begin) || fail "begin"
+client write $tx $f 7000 abc || fail "write"
+client commit $tx || fail "commit"
+check_clone() {
+    [ "$(client get $f)" = ${data:0:7000}abc${data:7003} ] ||
+        fail "$1: write to a clone changed its source"
+    [ "$(client get $g)" = ${data:0:100}XYZ${data:103} ] ||
+        fail "$1: write to a source changed its clone"
+}
+check_clone "after the writes"
+crash_server
+start_server
+check_clone "after a crash"
+tx=$(client begin) || fail "begin"
+client remove $tx $f || fail "remove"
+client remove $tx $g || fail "remove"
+client commit $tx || fail "commit"
+[ "$(client free)" = $free ] ||
+    fail "clone leaked blocks: $free free before, $(client free) after"
+
+echo "Passed RECOVERY TEST"